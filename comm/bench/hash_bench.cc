@@ -0,0 +1,185 @@
+// Hash32 against typical caller-supplied hashes: throughput by key size, and
+// the HandleTable chain lengths and lookup speed each hash gives.
+//
+//   g++ -std=c++11 -O2 -o hash_bench comm/bench/hash_bench.cc && ./hash_bench
+//
+// Keys are "user:" followed by a zero-padded decimal id, the kind of keys
+// that defeat hashes which only look at a prefix or mix weakly.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../lite_hash.h"
+
+namespace {
+
+typedef uint32_t (*HashFn)(const char *data, size_t n);
+
+// The first four bytes as an integer: every key here shares them.
+uint32_t PrefixHash(const char *data, size_t n) {
+  uint32_t h = 0;
+  memcpy(&h, data, n < 4 ? n : 4);
+  return h;
+}
+
+// s[0]*31^(n-1) + ... + s[n-1], as java.lang.String.hashCode().
+uint32_t Times31Hash(const char *data, size_t n) {
+  uint32_t h = 0;
+  for (size_t i = 0; i < n; i++) {
+    h = h * 31 + static_cast<uint8_t>(data[i]);
+  }
+  return h;
+}
+
+uint32_t StdHash(const char *data, size_t n) {
+  return static_cast<uint32_t>(std::hash<std::string>()(std::string(data, n)));
+}
+
+uint32_t BuiltinHash(const char *data, size_t n) { return Hash32(data, n); }
+
+struct NamedHash {
+  const char *name;
+  HashFn fn;
+};
+
+const NamedHash kHashes[] = {
+    {"prefix32", &PrefixHash},
+    {"times31", &Times31Hash},
+    {"std::hash", &StdHash},
+    {"Hash32", &BuiltinHash},
+};
+
+double NowSeconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string MakeKey(size_t id, size_t size) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "user:%012zu", id);
+  std::string key(buf);
+  key.resize(size < key.size() ? key.size() : size, 'x');
+  return key;
+}
+
+volatile uint32_t sink;
+
+void Throughput() {
+  printf("hash throughput, MB/s\n%-10s", "key bytes");
+  for (size_t k = 0; k < sizeof(kHashes) / sizeof(kHashes[0]); k++) {
+    printf(" %10s", kHashes[k].name);
+  }
+  printf("\n");
+  const size_t kSizes[] = {17, 32, 64, 256, 1024, 4096};
+  for (size_t s = 0; s < sizeof(kSizes) / sizeof(kSizes[0]); s++) {
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < 256; i++) {
+      keys.push_back(MakeKey(i, kSizes[s]));
+    }
+    printf("%-10zu", kSizes[s]);
+    for (size_t k = 0; k < sizeof(kHashes) / sizeof(kHashes[0]); k++) {
+      const size_t rounds = (64 << 20) / (kSizes[s] * keys.size()) + 1;
+      uint32_t acc = 0;
+      double start = NowSeconds();
+      for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < keys.size(); i++) {
+          acc += kHashes[k].fn(keys[i].data(), keys[i].size());
+        }
+      }
+      double secs = NowSeconds() - start;
+      sink = acc;
+      printf(" %10.0f", rounds * keys.size() * kSizes[s] / secs / 1e6);
+    }
+    printf("\n");
+  }
+}
+
+void DeleteHandles(std::vector<LRUHandle *> *handles) {
+  for (size_t i = 0; i < handles->size(); i++) {
+    free((*handles)[i]);
+  }
+  handles->clear();
+}
+
+// Inserts n keys hashed by fn, reports how they spread over the buckets,
+// and times hits.
+void Chains(const NamedHash &h, size_t n) {
+  std::vector<LRUHandle *> handles;
+  std::vector<std::string> keys;
+  HandleTable table;
+  for (size_t i = 0; i < n; i++) {
+    keys.push_back(MakeKey(i, 0));
+    LRUHandle *e = static_cast<LRUHandle *>(malloc(LRUHandle::SizeOf(keys[i].size())));
+    e->key_length = keys[i].size();
+    e->hash = h.fn(keys[i].data(), keys[i].size());
+    memcpy(e->key_data, keys[i].data(), keys[i].size());
+    table.Insert(e);
+    handles.push_back(e);
+  }
+
+  // Same bucket count as the table: the power of two at or above n.
+  size_t length = 4;
+  while (length < n) {
+    length *= 2;
+  }
+  std::vector<uint32_t> chain(length);
+  for (size_t i = 0; i < n; i++) {
+    chain[handles[i]->hash & (length - 1)]++;
+  }
+  size_t used = 0;
+  uint32_t longest = 0;
+  double probes = 0;  // keys compared per hit, summed
+  for (size_t b = 0; b < length; b++) {
+    used += chain[b] != 0;
+    longest = chain[b] > longest ? chain[b] : longest;
+    probes += chain[b] * (chain[b] + 1) / 2.0;
+  }
+
+  const size_t kLookups = 1 << 20;
+  std::vector<uint32_t> order(kLookups);
+  for (size_t i = 0; i < kLookups; i++) {
+    order[i] = static_cast<uint32_t>(rand() % n);
+  }
+  double start = NowSeconds();
+  size_t found = 0;
+  for (size_t i = 0; i < kLookups; i++) {
+    const std::string &key = keys[order[i]];
+    found += table.Lookup(key, h.fn(key.data(), key.size())) != nullptr;
+  }
+  double secs = NowSeconds() - start;
+  if (found != kLookups) {
+    fprintf(stderr, "%s: lost keys\n", h.name);
+    exit(1);
+  }
+  printf("%-10s %9zu %8.1f%% %8u %8.2f %9.1f\n", h.name, n, 100.0 * used / length, longest,
+         probes / n, secs / kLookups * 1e9);
+
+  for (size_t i = 0; i < n; i++) {
+    table.Remove(keys[i], handles[i]->hash);
+  }
+  DeleteHandles(&handles);
+}
+
+}  // namespace
+
+int main() {
+  Throughput();
+  printf("\nHandleTable, random hits\n%-10s %9s %9s %8s %8s %9s\n", "hash", "keys",
+         "used", "longest", "probes", "ns/hit");
+  const size_t kCounts[] = {1 << 10, 1 << 16, 1 << 20};
+  for (size_t c = 0; c < sizeof(kCounts) / sizeof(kCounts[0]); c++) {
+    for (size_t k = 0; k < sizeof(kHashes) / sizeof(kHashes[0]); k++) {
+      if (kHashes[k].fn == &PrefixHash && kCounts[c] > (1 << 10)) {
+        continue;  // a single chain; hits would take minutes
+      }
+      Chains(kHashes[k], kCounts[c]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,132 @@
+// Lookup latency of the two shard indexes, the chained HandleTable and
+// SwissHandleTable, on hits and misses at growing table sizes.
+//
+//   g++ -std=c++11 -O2 -march=native -o table_bench comm/bench/table_bench.cc && ./table_bench
+//
+// Keys are probed in random order, so past the last-level cache size every
+// probe pays its memory misses; that is where the chained table's pointer
+// chase shows. MultiLookup() rows time the batched, prefetching variant.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../lite_hash.h"
+#include "../swiss_table.h"
+
+namespace {
+
+const size_t kLookups = 1 << 21;
+const size_t kBatch = 16;
+
+double NowSeconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string MakeKey(uint64_t id) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "key:%016llx", static_cast<unsigned long long>(id));
+  return buf;
+}
+
+LRUHandle *NewHandle(const std::string &key) {
+  LRUHandle *e = static_cast<LRUHandle *>(malloc(LRUHandle::SizeOf(key.size())));
+  e->key_length = key.size();
+  e->hash = Hash32(key);
+  memcpy(e->key_data, key.data(), key.size());
+  return e;
+}
+
+struct Keys {
+  std::vector<std::string> strings;
+  std::vector<Slice> slices;
+  std::vector<uint32_t> hashes;
+
+  void Add(const std::string &key) {
+    strings.push_back(key);
+    hashes.push_back(Hash32(key));
+  }
+  // Slices point into strings, so take them once strings stops growing.
+  void Freeze() {
+    for (size_t i = 0; i < strings.size(); i++) {
+      slices.push_back(Slice(strings[i]));
+    }
+  }
+};
+
+// Nanoseconds per lookup of probe, one key at a time and in batches.
+template <class Table>
+void Time(Table *table, const Keys &probe, size_t expect, double *single, double *batched) {
+  size_t found = 0;
+  double start = NowSeconds();
+  for (size_t i = 0; i < probe.slices.size(); i++) {
+    found += table->Lookup(probe.slices[i], probe.hashes[i]) != nullptr;
+  }
+  *single = (NowSeconds() - start) / probe.slices.size() * 1e9;
+
+  LRUHandle *out[kBatch];
+  start = NowSeconds();
+  for (size_t i = 0; i + kBatch <= probe.slices.size(); i += kBatch) {
+    table->MultiLookup(kBatch, &probe.slices[i], &probe.hashes[i], out);
+    for (size_t j = 0; j < kBatch; j++) {
+      found += out[j] != nullptr;
+    }
+  }
+  *batched = (NowSeconds() - start) / probe.slices.size() * 1e9;
+
+  if (found != 2 * expect) {
+    fprintf(stderr, "found %zu of %zu\n", found / 2, expect);
+    exit(1);
+  }
+}
+
+template <class Table>
+void Run(const char *name, size_t n) {
+  std::mt19937_64 rng(n);
+  std::vector<LRUHandle *> handles;
+  std::vector<uint64_t> ids;
+  Table table;
+  for (size_t i = 0; i < n; i++) {
+    ids.push_back(rng());
+    handles.push_back(NewHandle(MakeKey(ids[i])));
+    table.Insert(handles[i]);
+  }
+
+  Keys hits, misses;
+  for (size_t i = 0; i < kLookups; i++) {
+    hits.Add(MakeKey(ids[rng() % n]));
+    misses.Add(MakeKey(rng() | 1) + "-");  // never inserted
+  }
+  hits.Freeze();
+  misses.Freeze();
+
+  double hit, hit_batched, miss, miss_batched;
+  Time(&table, hits, kLookups, &hit, &hit_batched);
+  Time(&table, misses, 0, &miss, &miss_batched);
+  printf("%-8s %9zu %8.1f %8.1f %8.1f %8.1f\n", name, n, hit, hit_batched, miss, miss_batched);
+
+  for (size_t i = 0; i < n; i++) {
+    table.Remove(handles[i]->key(), handles[i]->hash);
+    free(handles[i]);
+  }
+}
+
+}  // namespace
+
+int main() {
+  printf("ns per lookup\n%-8s %9s %8s %8s %8s %8s\n", "index", "entries", "hit", "hit x16",
+         "miss", "miss x16");
+  const size_t kCounts[] = {1 << 10, 1 << 14, 1 << 18, 1 << 22};
+  for (size_t c = 0; c < sizeof(kCounts) / sizeof(kCounts[0]); c++) {
+    Run<HandleTable>("chained", kCounts[c]);
+    Run<SwissHandleTable>("swiss", kCounts[c]);
+  }
+  return 0;
+}
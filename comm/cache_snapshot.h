@@ -0,0 +1,234 @@
+#pragma once
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "slice.h"
+
+// Snapshot of a cache's content, written on shutdown and read back to warm
+// the cache up on the next start. The file is
+//   magic: 8 bytes  record*  trailer
+// where a record is a SnapshotRecordHeader followed by key and value, and
+// the trailer is a record header with key_length kSnapshotTrailer, followed
+// by the record count and a SnapshotChecksum() chained over all records,
+// both uint64. Integers are in native byte order: a snapshot is meant for
+// the same host, not for exchange. Key hashes are not stored, since
+// Hash32() may change between releases; readers recompute them.
+static const char kSnapshotMagic[8] = {'C', 'O', 'M', 'M', 'S', 'N', 'P', '3'};
+static const uint32_t kSnapshotTrailer = 0xffffffffu;
+
+struct SnapshotRecordHeader {
+  uint32_t key_length;
+  uint32_t value_length;
+  uint64_t expire_at;  // on SnapshotClockMillis(), 0 if the entry has no TTL
+};
+
+// Milliseconds on the system clock. Unlike ExpiryClockMillis() it carries
+// over to the next process, so snapshots store deadlines on it.
+inline uint64_t SnapshotClockMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// 64-bit FNV-1a. Unlike Hash64() it is fixed, so files written by one
+// release still validate in the next.
+inline uint64_t SnapshotChecksum(const char *data, size_t n, uint64_t seed) {
+  uint64_t h = seed ^ 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < n; i++) {
+    h ^= static_cast<uint8_t>(data[i]);
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+// Writes a snapshot to path + ".tmp" and renames it over path in Finish(),
+// so a crash never leaves a partial snapshot behind under path.
+class CacheSnapshotWriter {
+ public:
+  // Returns nullptr and leaves errno set if the file cannot be created.
+  static CacheSnapshotWriter *Create(const std::string &path) {
+    std::string tmp = path + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "wbe");
+    if (file == nullptr) {
+      return nullptr;
+    }
+    CacheSnapshotWriter *writer = new CacheSnapshotWriter(path, tmp, file);
+    writer->Write(kSnapshotMagic, sizeof(kSnapshotMagic));
+    return writer;
+  }
+
+  // Drops the temporary file unless Finish() succeeded.
+  ~CacheSnapshotWriter() {
+    if (file_ != nullptr) {
+      fclose(file_);
+      unlink(tmp_.c_str());
+    }
+  }
+
+  CacheSnapshotWriter(const CacheSnapshotWriter &) = delete;
+  CacheSnapshotWriter &operator=(const CacheSnapshotWriter &) = delete;
+
+  void Add(const Slice &key, const Slice &value, uint64_t expire_at = 0) {
+    SnapshotRecordHeader header = {static_cast<uint32_t>(key.size()),
+                                   static_cast<uint32_t>(value.size()), expire_at};
+    checksum_ =
+        SnapshotChecksum(reinterpret_cast<const char *>(&header), sizeof(header), checksum_);
+    checksum_ = SnapshotChecksum(key.data(), key.size(), checksum_);
+    checksum_ = SnapshotChecksum(value.data(), value.size(), checksum_);
+    Write(&header, sizeof(header));
+    Write(key.data(), key.size());
+    Write(value.data(), value.size());
+    count_++;
+  }
+
+  // Writes the trailer, syncs the file and moves it into place. Returns
+  // false and leaves errno set on any I/O error since Create().
+  bool Finish() {
+    SnapshotRecordHeader header = {kSnapshotTrailer, 0, 0};
+    Write(&header, sizeof(header));
+    Write(&count_, sizeof(count_));
+    Write(&checksum_, sizeof(checksum_));
+    if (fflush(file_) != 0 || ferror(file_) || fsync(fileno(file_)) != 0) {
+      return false;
+    }
+    FILE *file = file_;
+    file_ = nullptr;
+    if (fclose(file) != 0 || rename(tmp_.c_str(), path_.c_str()) != 0) {
+      int saved = errno;
+      unlink(tmp_.c_str());
+      errno = saved;
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  CacheSnapshotWriter(const std::string &path, const std::string &tmp, FILE *file)
+      : path_(path), tmp_(tmp), file_(file), count_(0), checksum_(0) {}
+
+  // Errors are sticky in the FILE and reported by Finish().
+  void Write(const void *data, size_t n) {
+    if (n > 0) {
+      fwrite(data, 1, n, file_);
+    }
+  }
+
+  const std::string path_;
+  const std::string tmp_;
+  FILE *file_;
+  uint64_t count_;
+  uint64_t checksum_;
+};
+
+// Reads a whole snapshot into memory and validates it before handing out
+// any record, so a truncated or corrupt file yields nothing.
+class CacheSnapshotReader {
+ public:
+  // Returns nullptr and leaves errno set if the file cannot be read, or
+  // sets errno to EINVAL if it is not a complete, intact snapshot.
+  static CacheSnapshotReader *Open(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "rbe");
+    if (file == nullptr) {
+      return nullptr;
+    }
+    CacheSnapshotReader *reader = new CacheSnapshotReader;
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+      reader->data_.append(buf, n);
+    }
+    bool failed = ferror(file) != 0;
+    int saved = errno;
+    fclose(file);
+    if (failed) {
+      delete reader;
+      errno = saved;
+      return nullptr;
+    }
+    if (!reader->Validate()) {
+      delete reader;
+      errno = EINVAL;
+      return nullptr;
+    }
+    return reader;
+  }
+
+  CacheSnapshotReader(const CacheSnapshotReader &) = delete;
+  CacheSnapshotReader &operator=(const CacheSnapshotReader &) = delete;
+
+  uint64_t count() const { return count_; }
+
+  // Restarts Next() at the first record.
+  void Rewind() { pos_ = sizeof(kSnapshotMagic); }
+
+  // Returns the next record, in the order they were added, or false at the
+  // end. key and value point into the reader and live as long as it does.
+  // *expire_at is the deadline passed to Add().
+  bool Next(Slice *key, Slice *value, uint64_t *expire_at) {
+    SnapshotRecordHeader header;
+    memcpy(&header, data_.data() + pos_, sizeof(header));
+    if (header.key_length == kSnapshotTrailer) {
+      return false;
+    }
+    const char *p = data_.data() + pos_ + sizeof(header);
+    *key = Slice(p, header.key_length);
+    *value = Slice(p + header.key_length, header.value_length);
+    *expire_at = header.expire_at;
+    pos_ += sizeof(header) + header.key_length + header.value_length;
+    return true;
+  }
+
+ private:
+  CacheSnapshotReader() : pos_(sizeof(kSnapshotMagic)), count_(0) {}
+
+  // Walks every record once, checking lengths, count and checksum.
+  bool Validate() {
+    if (data_.size() < sizeof(kSnapshotMagic) ||
+        memcmp(data_.data(), kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) {
+      return false;
+    }
+    size_t pos = sizeof(kSnapshotMagic);
+    uint64_t count = 0;
+    uint64_t checksum = 0;
+    for (;;) {
+      SnapshotRecordHeader header;
+      if (data_.size() - pos < sizeof(header)) {
+        return false;
+      }
+      memcpy(&header, data_.data() + pos, sizeof(header));
+      if (header.key_length == kSnapshotTrailer) {
+        uint64_t trailer[2];
+        if (header.value_length != 0 || header.expire_at != 0 ||
+            data_.size() - pos - sizeof(header) != sizeof(trailer)) {
+          return false;
+        }
+        memcpy(trailer, data_.data() + pos + sizeof(header), sizeof(trailer));
+        count_ = count;
+        return trailer[0] == count && trailer[1] == checksum;
+      }
+      const size_t length = static_cast<size_t>(header.key_length) + header.value_length;
+      if (data_.size() - pos - sizeof(header) < length) {
+        return false;
+      }
+      const char *p = data_.data() + pos + sizeof(header);
+      checksum =
+          SnapshotChecksum(reinterpret_cast<const char *>(&header), sizeof(header), checksum);
+      checksum = SnapshotChecksum(p, header.key_length, checksum);
+      checksum = SnapshotChecksum(p + header.key_length, header.value_length, checksum);
+      pos += sizeof(header) + length;
+      count++;
+    }
+  }
+
+  std::string data_;
+  size_t pos_;
+  uint64_t count_;
+};
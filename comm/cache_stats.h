@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Build with -DCOMM_CACHE_STATS=1 to compile in the cache and hash table
+// counters. Without it the counters still exist but are never updated, so
+// snapshots read as zero and the hot paths carry no extra instructions.
+#ifndef COMM_CACHE_STATS
+#define COMM_CACHE_STATS 0
+#endif
+
+#if COMM_CACHE_STATS
+#define COMM_STATS_ADD(counter, n) ((counter) += (n))
+#else
+#define COMM_STATS_ADD(counter, n) ((void)0)
+#endif
+
+// Probe lengths are bucketed as 0, 1, 2, 3, 4-7, 8-15, 16+.
+static const int kProbeHistogramBuckets = 7;
+
+inline int ProbeHistogramBucket(uint32_t probes) {
+  if (probes < 4) {
+    return static_cast<int>(probes);
+  }
+  return probes < 8 ? 4 : (probes < 16 ? 5 : 6);
+}
+
+// Counters of one shard or, summed, of a whole cache. Shards update their
+// copy under the shard lock; GetStats() returns a snapshot.
+struct CacheStats {
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t inserts;
+  uint64_t replacements;  // inserts that replaced an entry with the same key
+  uint64_t evictions;     // entries dropped to make room, not Erase()/Prune()
+  uint64_t expirations;   // entries dropped because their TTL ran out
+
+  // Index behavior.
+  uint64_t resizes;
+  uint64_t resize_nanos;  // time spent rehashing, including incremental steps
+  // Lookups by probe length: entries stepped over in a HandleTable chain, or
+  // extra control groups visited in a SwissHandleTable.
+  uint64_t probe_histogram[kProbeHistogramBuckets];
+
+  CacheStats() { Clear(); }
+
+  void Clear() {
+    lookups = hits = inserts = replacements = evictions = expirations = 0;
+    resizes = resize_nanos = 0;
+    for (int i = 0; i < kProbeHistogramBuckets; i++) {
+      probe_histogram[i] = 0;
+    }
+  }
+
+  void Add(const CacheStats &other) {
+    lookups += other.lookups;
+    hits += other.hits;
+    inserts += other.inserts;
+    replacements += other.replacements;
+    evictions += other.evictions;
+    expirations += other.expirations;
+    resizes += other.resizes;
+    resize_nanos += other.resize_nanos;
+    for (int i = 0; i < kProbeHistogramBuckets; i++) {
+      probe_histogram[i] += other.probe_histogram[i];
+    }
+  }
+
+  std::string ToString() const {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "lookups=%llu hits=%llu inserts=%llu replacements=%llu evictions=%llu "
+             "expirations=%llu resizes=%llu resize_us=%llu probes[0,1,2,3,4-7,8-15,16+]="
+             "%llu,%llu,%llu,%llu,%llu,%llu,%llu",
+             (unsigned long long)lookups, (unsigned long long)hits,
+             (unsigned long long)inserts, (unsigned long long)replacements,
+             (unsigned long long)evictions, (unsigned long long)expirations,
+             (unsigned long long)resizes,
+             (unsigned long long)(resize_nanos / 1000), (unsigned long long)probe_histogram[0],
+             (unsigned long long)probe_histogram[1], (unsigned long long)probe_histogram[2],
+             (unsigned long long)probe_histogram[3], (unsigned long long)probe_histogram[4],
+             (unsigned long long)probe_histogram[5], (unsigned long long)probe_histogram[6]);
+    return buf;
+  }
+};
+
+// Adds the lifetime of the timer to *nanos when stats are compiled in.
+class StatsTimer {
+ public:
+#if COMM_CACHE_STATS
+  explicit StatsTimer(uint64_t *nanos) : nanos_(nanos), start_(std::chrono::steady_clock::now()) {}
+  ~StatsTimer() {
+    *nanos_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - start_)
+                   .count();
+  }
+
+ private:
+  uint64_t *nanos_;
+  std::chrono::steady_clock::time_point start_;
+#else
+  explicit StatsTimer(uint64_t *) {}
+#endif
+};
@@ -0,0 +1,519 @@
+#pragma once
+#include <assert.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "lite_hash.h"
+#include "slice.h"
+
+// Slab like HandleSlab whose objects are named by 32-bit references instead
+// of pointers. Pages are kPageSize-aligned and start with a header holding
+// their index, so a reference is (page index << 12) | (offset / kAlign) and
+// can also be recovered from an object's address. Unit 0 of every page is
+// the header, which makes 0 free to serve as the null reference. With 20
+// bits of page index a slab addresses 64 GiB.
+class CompactSlab {
+ public:
+  static const size_t kAlign = 16;
+  static const size_t kMaxBytes = 1024;
+  static const size_t kNumClasses = kMaxBytes / kAlign;
+  static const size_t kPageSize = 64 << 10;
+  static const int kUnitBits = 12;  // log2(kPageSize / kAlign)
+  static const uint32_t kMaxPages = 1u << (32 - kUnitBits);
+  static const uint32_t kNullRef = 0;
+  static const int kRefillObjects = 32;
+
+  CompactSlab() : page_start_(0), page_end_(0) {
+    for (size_t i = 0; i < kNumClasses; i++) {
+      free_list_[i] = kNullRef;
+    }
+  }
+
+  ~CompactSlab() {
+    for (size_t i = 0; i < pages_.size(); i++) {
+      free(pages_[i]);
+    }
+  }
+
+  CompactSlab(const CompactSlab &) = delete;
+  CompactSlab &operator=(const CompactSlab &) = delete;
+
+  // n must be at most kMaxBytes. Returns kNullRef once kMaxPages pages are
+  // in use, or a new page cannot be allocated, and no free object of the
+  // size is left.
+  uint32_t Allocate(size_t n) {
+    assert(n <= kMaxBytes);
+    uint32_t *list = &free_list_[ClassIndex(n)];
+    uint32_t result = *list;
+    if (result == kNullRef) {
+      return Refill(RoundUp(n));
+    }
+    *list = Link(result);
+    return result;
+  }
+
+  // n must be the size passed to Allocate().
+  void Free(uint32_t ref, size_t n) {
+    uint32_t *list = &free_list_[ClassIndex(n)];
+    Link(ref) = *list;
+    *list = ref;
+  }
+
+  char *Get(uint32_t ref) const {
+    return pages_[ref >> kUnitBits] + (ref & ((1u << kUnitBits) - 1)) * kAlign;
+  }
+
+  uint32_t RefOf(const void *p) const {
+    uintptr_t offset = reinterpret_cast<uintptr_t>(p) & (kPageSize - 1);
+    const char *page = static_cast<const char *>(p) - offset;
+    uint32_t index;
+    memcpy(&index, page, sizeof(index));
+    return (index << kUnitBits) | static_cast<uint32_t>(offset / kAlign);
+  }
+
+  size_t page_bytes() const { return pages_.size() * kPageSize; }
+
+ private:
+  static size_t RoundUp(size_t n) { return (n + kAlign - 1) & ~(kAlign - 1); }
+  static size_t ClassIndex(size_t n) { return (n + kAlign - 1) / kAlign - 1; }
+
+  // Free objects keep the next reference of their list in their first bytes.
+  uint32_t &Link(uint32_t ref) const { return *reinterpret_cast<uint32_t *>(Get(ref)); }
+
+  uint32_t Refill(size_t n) {
+    int nobjs = kRefillObjects;
+    uint32_t chunk = CarveChunk(n, &nobjs);
+    if (chunk == kNullRef) {
+      return kNullRef;
+    }
+    const uint32_t units = static_cast<uint32_t>(n / kAlign);
+    uint32_t *list = &free_list_[ClassIndex(n)];
+    for (int i = nobjs - 1; i >= 1; i--) {
+      uint32_t o = chunk + i * units;
+      Link(o) = *list;
+      *list = o;
+    }
+    return chunk;
+  }
+
+  // Same as HandleSlab::CarveChunk(), in units of kAlign bytes.
+  uint32_t CarveChunk(size_t n, int *nobjs) {
+    const uint32_t units = static_cast<uint32_t>(n / kAlign);
+    uint32_t left = page_end_ - page_start_;
+    if (left < units) {
+      if (pages_.size() == kMaxPages) {
+        return kNullRef;
+      }
+      char *page = static_cast<char *>(aligned_alloc(kPageSize, kPageSize));
+      if (page == nullptr) {
+        return kNullRef;
+      }
+      if (left > 0) {
+        Free(page_start_, left * kAlign);
+      }
+      uint32_t index = static_cast<uint32_t>(pages_.size());
+      memcpy(page, &index, sizeof(index));
+      pages_.push_back(page);
+      page_start_ = (index << kUnitBits) | 1;  // unit 0 is the header
+      page_end_ = (index + 1) << kUnitBits;    // wraps to 0 for the last page
+      left = page_end_ - page_start_;
+    }
+    if (left < units * *nobjs) {
+      *nobjs = static_cast<int>(left / units);
+    }
+    uint32_t result = page_start_;
+    page_start_ += units * *nobjs;
+    return result;
+  }
+
+  uint32_t free_list_[kNumClasses];
+  uint32_t page_start_;  // unused rest of the newest page
+  uint32_t page_end_;
+  std::vector<char *> pages_;
+};
+
+// An entry of a CompactLRUCache. All links are CompactSlab references; the
+// deleter is per cache rather than per entry. 35 bytes of metadata against
+// 72 in LRUHandle, which adds a 24-byte trailer to entries with a TTL.
+struct CompactHandle {
+  void *value;
+  uint32_t next_hash;
+  uint32_t next;  // LRU list, towards newer entries
+  uint32_t prev;
+  uint32_t hash;
+  uint32_t charge;
+  uint32_t refs;
+  uint16_t key_length;
+  bool in_cache;
+  char key_data[1];  // Beginning of key
+
+  Slice key() const { return Slice(key_data, key_length); }
+
+  static size_t SizeOf(size_t key_length) {
+    return offsetof(CompactHandle, key_data) + key_length;
+  }
+};
+
+// Backs the figures above and the "about half" of CompactLRUCache: an
+// entry's metadata plus its bucket slot, against LRUHandle's.
+static_assert(sizeof(void *) != 8 || offsetof(CompactHandle, key_data) == 35,
+              "CompactHandle metadata is no longer 35 bytes");
+static_assert(2 * (offsetof(CompactHandle, key_data) + sizeof(uint32_t)) <=
+                  offsetof(LRUHandle, key_data) + sizeof(LRUHandle *),
+              "CompactHandle no longer halves the per-entry index cost");
+
+// Memory-lean counterpart of BasicLRUCache<HandleTable> for caches with a
+// very large number of small entries. Entries are CompactHandles in a
+// CompactSlab, the hash chains and the LRU list link them by 32-bit
+// references and the bucket array holds 4-byte references, so the index
+// costs about half of what the pointer-based cache spends per entry.
+//
+// In exchange the cache is strict LRU only, every entry shares one deleter,
+// keys are limited to kMaxKeyLength bytes and charges to 32 bits, and a
+// shard holds at most 64 GiB of entries.
+class CompactLRUCache {
+ public:
+  static const size_t kMaxKeyLength =
+      CompactSlab::kMaxBytes - offsetof(CompactHandle, key_data);
+
+  CompactLRUCache()
+      : capacity_(0),
+        deleter_(nullptr),
+        usage_(0),
+        oldest_(CompactSlab::kNullRef),
+        newest_(CompactSlab::kNullRef),
+        length_(0),
+        elems_(0),
+        list_(nullptr) {
+    Resize(kMinLength);
+  }
+
+  ~CompactLRUCache() {
+    Prune();
+    assert(elems_ == 0);  // Error if caller has an unreleased handle
+    delete[] list_;
+  }
+
+  CompactLRUCache(const CompactLRUCache &) = delete;
+  CompactLRUCache &operator=(const CompactLRUCache &) = delete;
+
+  void SetCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> l(mutex_);
+    capacity_ = capacity;
+  }
+
+  // Must be called before the first Insert().
+  void SetDeleter(CacheDeleter deleter) { deleter_ = deleter; }
+
+  // Returns nullptr, without taking ownership of value, if the key is
+  // longer than kMaxKeyLength, charge does not fit in 32 bits, or the shard
+  // is out of references or memory.
+  CompactHandle *Insert(const Slice &key, uint32_t hash, void *value, size_t charge) {
+    if (key.size() > kMaxKeyLength || charge > UINT32_MAX) {
+      return nullptr;
+    }
+    std::lock_guard<std::mutex> l(mutex_);
+    uint32_t ref = slab_.Allocate(CompactHandle::SizeOf(key.size()));
+    if (ref == CompactSlab::kNullRef) {
+      return nullptr;
+    }
+    CompactHandle *e = Get(ref);
+    e->value = value;
+    e->hash = hash;
+    e->charge = static_cast<uint32_t>(charge);
+    e->refs = 1;  // for the returned handle.
+    e->key_length = static_cast<uint16_t>(key.size());
+    e->in_cache = false;
+    memcpy(e->key_data, key.data(), key.size());
+
+    if (capacity_ > 0) {
+      e->refs++;  // for the cache's reference.
+      e->in_cache = true;
+      usage_ += e->charge;
+      FinishErase(TableInsert(ref));
+      Append(ref);
+    }
+    while (usage_ > capacity_ && oldest_ != CompactSlab::kNullRef) {
+      uint32_t victim = oldest_;
+      while (victim != CompactSlab::kNullRef && Get(victim)->refs > 1) {
+        victim = Get(victim)->next;
+      }
+      if (victim == CompactSlab::kNullRef) {
+        break;
+      }
+      CompactHandle *v = Get(victim);
+      FinishErase(TableRemove(v->key(), v->hash));
+    }
+    return e;
+  }
+
+  CompactHandle *Lookup(const Slice &key, uint32_t hash) {
+    std::lock_guard<std::mutex> l(mutex_);
+    uint32_t ref = *FindPointer(key, hash);
+    if (ref == CompactSlab::kNullRef) {
+      return nullptr;
+    }
+    CompactHandle *e = Get(ref);
+    e->refs++;
+    Unlink(ref);
+    Append(ref);
+    return e;
+  }
+
+  void Release(CompactHandle *handle) {
+    std::lock_guard<std::mutex> l(mutex_);
+    Unref(slab_.RefOf(handle));
+  }
+
+  void Erase(const Slice &key, uint32_t hash) {
+    std::lock_guard<std::mutex> l(mutex_);
+    FinishErase(TableRemove(key, hash));
+  }
+
+  // Drops every entry that is not pinned by a client.
+  void Prune() {
+    std::lock_guard<std::mutex> l(mutex_);
+    uint32_t ref = oldest_;
+    while (ref != CompactSlab::kNullRef) {
+      CompactHandle *e = Get(ref);
+      uint32_t next = e->next;
+      if (e->refs == 1) {
+        FinishErase(TableRemove(e->key(), e->hash));
+      }
+      ref = next;
+    }
+  }
+
+  size_t TotalCharge() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    return usage_;
+  }
+
+  // Bytes taken by entries (including free slab space) and buckets.
+  size_t MemoryUsage() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    return slab_.page_bytes() + sizeof(list_[0]) * length_;
+  }
+
+ private:
+  static const uint32_t kMinLength = 4;
+
+  CompactHandle *Get(uint32_t ref) const {
+    return reinterpret_cast<CompactHandle *>(slab_.Get(ref));
+  }
+
+  // LRU list, oldest_ to newest_.
+  void Append(uint32_t ref) {
+    CompactHandle *e = Get(ref);
+    e->next = CompactSlab::kNullRef;
+    e->prev = newest_;
+    if (newest_ != CompactSlab::kNullRef) {
+      Get(newest_)->next = ref;
+    } else {
+      oldest_ = ref;
+    }
+    newest_ = ref;
+  }
+
+  void Unlink(uint32_t ref) {
+    CompactHandle *e = Get(ref);
+    if (e->prev != CompactSlab::kNullRef) {
+      Get(e->prev)->next = e->next;
+    } else {
+      oldest_ = e->next;
+    }
+    if (e->next != CompactSlab::kNullRef) {
+      Get(e->next)->prev = e->prev;
+    } else {
+      newest_ = e->prev;
+    }
+  }
+
+  void Unref(uint32_t ref) {
+    CompactHandle *e = Get(ref);
+    assert(e->refs > 0);
+    e->refs--;
+    if (e->refs == 0) {  // Deallocate.
+      assert(!e->in_cache);
+      (*deleter_)(e->key(), e->value);
+      slab_.Free(ref, CompactHandle::SizeOf(e->key_length));
+    }
+  }
+
+  // Finishes removing ref, which has just been unlinked from the table.
+  void FinishErase(uint32_t ref) {
+    if (ref != CompactSlab::kNullRef) {
+      CompactHandle *e = Get(ref);
+      assert(e->in_cache);
+      Unlink(ref);
+      e->in_cache = false;
+      usage_ -= e->charge;
+      Unref(ref);
+    }
+  }
+
+  // Hash table over references with HandleTable's resize thresholds.
+  uint32_t *FindPointer(const Slice &key, uint32_t hash) {
+    uint32_t *ptr = &list_[hash & (length_ - 1)];
+    while (*ptr != CompactSlab::kNullRef) {
+      CompactHandle *e = Get(*ptr);
+      if (e->hash == hash && key == e->key()) {
+        break;
+      }
+      ptr = &e->next_hash;
+    }
+    return ptr;
+  }
+
+  // Returns the reference replaced by ref, or kNullRef.
+  uint32_t TableInsert(uint32_t ref) {
+    CompactHandle *h = Get(ref);
+    uint32_t *ptr = FindPointer(h->key(), h->hash);
+    uint32_t old = *ptr;
+    h->next_hash = old == CompactSlab::kNullRef ? CompactSlab::kNullRef : Get(old)->next_hash;
+    *ptr = ref;
+    if (old == CompactSlab::kNullRef && ++elems_ > length_) {
+      Resize(RoundUpLength(elems_));
+    }
+    return old;
+  }
+
+  uint32_t TableRemove(const Slice &key, uint32_t hash) {
+    uint32_t *ptr = FindPointer(key, hash);
+    uint32_t result = *ptr;
+    if (result != CompactSlab::kNullRef) {
+      *ptr = Get(result)->next_hash;
+      if (--elems_ < length_ / 4 && length_ > kMinLength) {
+        Resize(RoundUpLength(elems_ * 2));
+      }
+    }
+    return result;
+  }
+
+  static uint32_t RoundUpLength(uint32_t n) {
+    uint32_t length = kMinLength;
+    while (length < n) {
+      length *= 2;
+    }
+    return length;
+  }
+
+  void Resize(uint32_t new_length) {
+    uint32_t *new_list = new uint32_t[new_length];
+    memset(new_list, 0, sizeof(new_list[0]) * new_length);
+    for (uint32_t i = 0; i < length_; i++) {
+      uint32_t ref = list_[i];
+      while (ref != CompactSlab::kNullRef) {
+        CompactHandle *h = Get(ref);
+        uint32_t next = h->next_hash;
+        uint32_t *ptr = &new_list[h->hash & (new_length - 1)];
+        h->next_hash = *ptr;
+        *ptr = ref;
+        ref = next;
+      }
+    }
+    delete[] list_;
+    list_ = new_list;
+    length_ = new_length;
+  }
+
+  size_t capacity_;
+  CacheDeleter deleter_;
+
+  // mutex_ protects the following state.
+  mutable std::mutex mutex_;
+  size_t usage_;
+  CompactSlab slab_;
+  uint32_t oldest_;
+  uint32_t newest_;
+  uint32_t length_;
+  uint32_t elems_;
+  uint32_t *list_;
+};
+
+// Sharded front end of CompactLRUCache, with the shard selection of
+// BasicShardedLRUCache.
+class CompactShardedLRUCache {
+ public:
+  // Opaque handle to an entry; valid until passed to Release().
+  struct Handle {};
+
+  CompactShardedLRUCache(size_t capacity, CacheDeleter deleter, int num_shard_bits = 6)
+      : num_shard_bits_(num_shard_bits) {
+    assert(num_shard_bits_ >= 0 && num_shard_bits_ < 32);
+    const size_t num_shards = NumShards();
+    const size_t per_shard = (capacity + (num_shards - 1)) / num_shards;
+    shard_ = new CompactLRUCache[num_shards];
+    for (size_t s = 0; s < num_shards; s++) {
+      shard_[s].SetCapacity(per_shard);
+      shard_[s].SetDeleter(deleter);
+    }
+  }
+  ~CompactShardedLRUCache() { delete[] shard_; }
+
+  CompactShardedLRUCache(const CompactShardedLRUCache &) = delete;
+  CompactShardedLRUCache &operator=(const CompactShardedLRUCache &) = delete;
+
+  // Returns nullptr, leaving value to the caller, if the key is longer than
+  // CompactLRUCache::kMaxKeyLength or charge does not fit in 32 bits.
+  Handle *Insert(const Slice &key, uint32_t hash, void *value, size_t charge) {
+    return reinterpret_cast<Handle *>(shard_[Shard(hash)].Insert(key, hash, value, charge));
+  }
+  Handle *Insert(const Slice &key, void *value, size_t charge) {
+    return Insert(key, Hash32(key), value, charge);
+  }
+
+  Handle *Lookup(const Slice &key, uint32_t hash) {
+    return reinterpret_cast<Handle *>(shard_[Shard(hash)].Lookup(key, hash));
+  }
+  Handle *Lookup(const Slice &key) { return Lookup(key, Hash32(key)); }
+
+  void Release(Handle *handle) {
+    CompactHandle *h = reinterpret_cast<CompactHandle *>(handle);
+    shard_[Shard(h->hash)].Release(h);
+  }
+
+  void *Value(Handle *handle) { return reinterpret_cast<CompactHandle *>(handle)->value; }
+
+  void Erase(const Slice &key, uint32_t hash) { shard_[Shard(hash)].Erase(key, hash); }
+  void Erase(const Slice &key) { Erase(key, Hash32(key)); }
+
+  void Prune() {
+    for (size_t s = 0; s < NumShards(); s++) {
+      shard_[s].Prune();
+    }
+  }
+
+  size_t TotalCharge() const {
+    size_t total = 0;
+    for (size_t s = 0; s < NumShards(); s++) {
+      total += shard_[s].TotalCharge();
+    }
+    return total;
+  }
+
+  size_t MemoryUsage() const {
+    size_t total = 0;
+    for (size_t s = 0; s < NumShards(); s++) {
+      total += shard_[s].MemoryUsage();
+    }
+    return total;
+  }
+
+  size_t NumShards() const { return size_t{1} << num_shard_bits_; }
+
+ private:
+  uint32_t Shard(uint32_t hash) const {
+    return num_shard_bits_ == 0 ? 0 : hash >> (32 - num_shard_bits_);
+  }
+
+  const int num_shard_bits_;
+  CompactLRUCache *shard_;
+};
@@ -0,0 +1,264 @@
+#pragma once
+#include <assert.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "epoch.h"
+#include "hash.h"
+#include "lite_hash.h"
+#include "slice.h"
+
+// Chained hash table over LRUHandle with lock-free Lookup. Writers (Insert,
+// Remove, and the resizes they trigger) serialize on an internal mutex.
+//
+// Readers run inside a ReadGuard, which holds an epoch critical section.
+// Bucket heads and next_hash links are published with release stores, and a
+// handle's other fields are never written after it has been inserted, so a
+// reader always sees either the old or the new chain. Handles that Insert()
+// replaces or Remove() unlinks may still be in use by readers: free them
+// through Retire(), never directly.
+//
+// Resizes never divert a reader into a chain that lacks its key, so Lookup
+// is a single pass even while one runs (relativistic hash tables, Triplett
+// et al.). Growing points each new bucket into the old chain it splits from
+// and publishes the new array; once the old array has no readers left, the
+// interleaved chains are unzipped one link per chain per grace period.
+// Shrinking appends each upper chain to its lower partner before publishing
+// the smaller array, and retires the old one. A reader may walk past keys of
+// a sibling bucket, never past its own.
+//
+// Writers wait for grace periods, so no thread may call Insert, Remove,
+// Retire or Reclaim while it holds a ReadGuard on the same table.
+class ConcurrentHandleTable {
+ public:
+  // Keeps handles returned by Lookup() alive for the guard's lifetime.
+  class ReadGuard : public EpochGuard {
+   public:
+    explicit ReadGuard(ConcurrentHandleTable *table) : EpochGuard(&table->epoch_) {}
+  };
+
+  ConcurrentHandleTable() : elems_(0) {
+    initial_.length = kMinLength;
+    initial_.heap = false;
+    memset(initial_.list, 0, sizeof(initial_.list));
+    buckets_.store(&initial_, std::memory_order_relaxed);
+  }
+  ~ConcurrentHandleTable() {
+    epoch_.Reclaim();
+    FreeBuckets(buckets_.load(std::memory_order_relaxed));
+  }
+
+  ConcurrentHandleTable(const ConcurrentHandleTable &) = delete;
+  ConcurrentHandleTable &operator=(const ConcurrentHandleTable &) = delete;
+
+  // Lock-free. Must be called inside a ReadGuard on this table; the result
+  // may be dereferenced until that guard is destroyed.
+  LRUHandle *Lookup(const Slice &key, uint32_t hash) const {
+    const BucketArray *b = buckets_.load(std::memory_order_acquire);
+    LRUHandle *h = Load(&b->list[hash & (b->length - 1)]);
+    while (h != nullptr && (h->hash != hash || key != h->key())) {
+      h = Load(&h->next_hash);
+    }
+    return h;
+  }
+  LRUHandle *Lookup(const Slice &key) const { return Lookup(key, Hash32(key)); }
+
+  // Returns the replaced handle, which the caller must Retire().
+  LRUHandle *Insert(LRUHandle *h) {
+    std::lock_guard<std::mutex> l(write_mutex_);
+    LRUHandle **ptr = FindPointer(h->key(), h->hash);
+    LRUHandle *old = *ptr;
+    Store(&h->next_hash, old == nullptr ? nullptr : old->next_hash);
+    Store(ptr, h);
+    if (old == nullptr) {
+      ++elems_;
+      MaybeResize();
+    }
+    return old;
+  }
+
+  // Returns the unlinked handle, which the caller must Retire().
+  LRUHandle *Remove(const Slice &key, uint32_t hash) {
+    std::lock_guard<std::mutex> l(write_mutex_);
+    LRUHandle **ptr = FindPointer(key, hash);
+    LRUHandle *result = *ptr;
+    if (result != nullptr) {
+      Store(ptr, result->next_hash);
+      --elems_;
+      MaybeResize();
+    }
+    return result;
+  }
+  LRUHandle *Remove(const Slice &key) { return Remove(key, Hash32(key)); }
+
+  // Calls deleter(p) once no ReadGuard that might have seen p is left.
+  void Retire(void *p, EpochManager::Deleter deleter) {
+    std::lock_guard<std::mutex> l(write_mutex_);
+    epoch_.Retire(p, deleter);
+  }
+
+  // Waits for current readers and runs all pending Retire() deleters.
+  void Reclaim() {
+    std::lock_guard<std::mutex> l(write_mutex_);
+    epoch_.Reclaim();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> l(write_mutex_);
+    return elems_;
+  }
+
+ private:
+  static const uint32_t kMinLength = 4;
+
+  // Longer arrays are allocated with room for the rest of list[]. The
+  // constructor uses initial_, so it cannot fail.
+  struct BucketArray {
+    uint32_t length;
+    bool heap;  // false for initial_
+    LRUHandle *list[kMinLength];
+  };
+
+  static LRUHandle *Load(LRUHandle *const *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+  static void Store(LRUHandle **p, LRUHandle *v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+
+  // Returns nullptr if out of memory.
+  static BucketArray *NewBuckets(uint32_t length) {
+    size_t bytes = sizeof(BucketArray) + sizeof(LRUHandle *) * (length - kMinLength);
+    BucketArray *b = static_cast<BucketArray *>(malloc(bytes));
+    if (b == nullptr) {
+      return nullptr;
+    }
+    b->length = length;
+    b->heap = true;
+    memset(b->list, 0, sizeof(LRUHandle *) * length);
+    return b;
+  }
+
+  static void FreeBuckets(void *b) {
+    if (static_cast<BucketArray *>(b)->heap) {
+      free(b);
+    }
+  }
+
+  // Writer side; write_mutex_ must be held.
+  LRUHandle **FindPointer(const Slice &key, uint32_t hash) {
+    BucketArray *b = buckets_.load(std::memory_order_relaxed);
+    LRUHandle **ptr = &b->list[hash & (b->length - 1)];
+    while (*ptr != nullptr && ((*ptr)->hash != hash || key != (*ptr)->key())) {
+      ptr = &(*ptr)->next_hash;
+    }
+    return ptr;
+  }
+
+  // Same thresholds as HandleTable: grow above a load of 1, shrink below 1/4.
+  // A failed allocation leaves the table at its current size.
+  void MaybeResize() {
+    uint32_t length = buckets_.load(std::memory_order_relaxed)->length;
+    if (elems_ > length) {
+      while (length < elems_ && Grow()) {
+        length *= 2;
+      }
+    } else if (length > kMinLength && elems_ < length / 4) {
+      while (length > kMinLength && elems_ * 2 <= length / 2 && Shrink()) {
+        length /= 2;
+      }
+    }
+  }
+
+  // Doubles the bucket count. Returns false if out of memory.
+  bool Grow() {
+    BucketArray *old = buckets_.load(std::memory_order_relaxed);
+    const uint32_t half = old->length;
+    BucketArray *b = NewBuckets(half * 2);
+    if (b == nullptr) {
+      return false;
+    }
+    const uint32_t mask = b->length - 1;
+    std::vector<LRUHandle *> pos(old->list, old->list + half);
+    // Old chain i holds the keys of new buckets i and i + half, interleaved.
+    // Each new bucket starts at its first node there.
+    for (uint32_t i = 0; i < half; i++) {
+      for (LRUHandle *h = old->list[i]; h != nullptr; h = h->next_hash) {
+        LRUHandle **head = &b->list[h->hash & mask];
+        if (*head == nullptr) {
+          *head = h;
+        }
+      }
+    }
+    buckets_.store(b, std::memory_order_release);
+    epoch_.Synchronize();
+    FreeBuckets(old);
+
+    // pos[i] is where unzipping chain i resumes. Each pass redirects the
+    // last node of one run past the following run of the other bucket.
+    // Readers of that other bucket may still be on the run, never at the
+    // node before it: they entered the run from its own bucket head or from
+    // a link the previous pass fixed, with a grace period in between.
+    for (;;) {
+      bool changed = false;
+      for (uint32_t i = 0; i < half; i++) {
+        LRUHandle *p = pos[i];
+        if (p == nullptr) {
+          continue;
+        }
+        const uint32_t bucket = p->hash & mask;
+        while (p->next_hash != nullptr && (p->next_hash->hash & mask) == bucket) {
+          p = p->next_hash;
+        }
+        LRUHandle *y = p->next_hash;
+        if (y == nullptr) {
+          pos[i] = nullptr;
+          continue;
+        }
+        LRUHandle *q = y->next_hash;
+        while (q != nullptr && (q->hash & mask) != bucket) {
+          q = q->next_hash;
+        }
+        Store(&p->next_hash, q);
+        pos[i] = y;
+        changed = true;
+      }
+      if (!changed) {
+        break;
+      }
+      epoch_.Synchronize();
+    }
+    return true;
+  }
+
+  // Halves the bucket count. Returns false if out of memory.
+  bool Shrink() {
+    BucketArray *old = buckets_.load(std::memory_order_relaxed);
+    const uint32_t half = old->length / 2;
+    BucketArray *b = NewBuckets(half);
+    if (b == nullptr) {
+      return false;
+    }
+    // Readers of old bucket i will see the keys of i + half too; that only
+    // costs them comparisons.
+    for (uint32_t i = 0; i < half; i++) {
+      LRUHandle **tail = &old->list[i];
+      while (*tail != nullptr) {
+        tail = &(*tail)->next_hash;
+      }
+      Store(tail, old->list[i + half]);
+      b->list[i] = old->list[i];
+    }
+    buckets_.store(b, std::memory_order_release);
+    epoch_.Retire(old, &FreeBuckets);
+    return true;
+  }
+
+  mutable EpochManager epoch_;
+  mutable std::mutex write_mutex_;
+  uint32_t elems_;  // protected by write_mutex_
+  std::atomic<BucketArray *> buckets_;
+  BucketArray initial_;
+};
@@ -0,0 +1,135 @@
+#pragma once
+#include <assert.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Read-side critical sections and deferred reclamation for lock-free readers.
+//
+// A reader claims one of kSlots reader slots for the duration of a critical
+// section by moving the slot's sequence from even (idle) to odd (active).
+// Threads start probing at a per-thread slot, so a reader normally does one
+// uncontended CAS on a cache line nobody else touches.
+//
+// Synchronize() waits for a grace period: every slot that was active when it
+// started has since left its critical section. Memory that was unlinked
+// before Synchronize() can no longer be reached by any reader once it
+// returns. Retire() queues memory for that and frees it in batches.
+//
+// Enter/Exit/Synchronize may be called from any thread; Synchronize() only
+// reads the slots, so writers of several structures can share a manager.
+// Retire/Reclaim must be serialized by the caller, normally by the writer
+// lock of the structure. None of the last three may be called from inside a
+// critical section of the same manager: the grace period would wait for
+// the caller itself. Debug builds assert that; Synchronize() knows which
+// thread holds each slot.
+class EpochManager {
+ public:
+  static const size_t kSlots = 128;
+  static const size_t kRetireBatch = 64;
+
+  typedef void (*Deleter)(void *);
+
+  EpochManager() {
+    for (size_t i = 0; i < kSlots; i++) {
+      slots_[i].seq.store(0, std::memory_order_relaxed);
+      slots_[i].owner.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+  ~EpochManager() { Reclaim(); }
+
+  EpochManager(const EpochManager &) = delete;
+  EpochManager &operator=(const EpochManager &) = delete;
+
+  // Returns the claimed slot, to be handed back to Exit().
+  size_t Enter() {
+    static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (size_t i = hint % kSlots;; i = (i + 1) % kSlots) {
+      uint64_t s = slots_[i].seq.load(std::memory_order_relaxed);
+      if ((s & 1) == 0 &&
+          slots_[i].seq.compare_exchange_weak(s, s + 1, std::memory_order_seq_cst)) {
+        slots_[i].owner.store(ThreadTag(), std::memory_order_relaxed);
+        hint = i;
+        return i;
+      }
+    }
+  }
+
+  void Exit(size_t slot) {
+    slots_[slot].owner.store(nullptr, std::memory_order_relaxed);
+    slots_[slot].seq.fetch_add(1, std::memory_order_release);
+  }
+
+  // Blocks until every critical section active at the time of the call has
+  // ended.
+  void Synchronize() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (size_t i = 0; i < kSlots; i++) {
+      uint64_t s = slots_[i].seq.load(std::memory_order_acquire);
+      if ((s & 1) != 0) {
+        // Our own slot would never be released.
+        assert(slots_[i].owner.load(std::memory_order_relaxed) != ThreadTag());
+        while (slots_[i].seq.load(std::memory_order_acquire) == s) {
+          std::this_thread::yield();
+        }
+      }
+    }
+  }
+
+  // Frees p with deleter once no reader can still hold it. p must already be
+  // unreachable for readers that start from now on.
+  void Retire(void *p, Deleter deleter) {
+    retired_.push_back(std::make_pair(p, deleter));
+    if (retired_.size() >= kRetireBatch) {
+      Reclaim();
+    }
+  }
+
+  // Waits for a grace period and frees everything retired so far.
+  void Reclaim() {
+    if (retired_.empty()) {
+      return;
+    }
+    Synchronize();
+    for (size_t i = 0; i < retired_.size(); i++) {
+      (*retired_[i].second)(retired_[i].first);
+    }
+    retired_.clear();
+  }
+
+  size_t pending() const { return retired_.size(); }
+
+ private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> seq;        // odd while a reader is inside
+    std::atomic<const void *> owner;  // ThreadTag() of that reader
+  };
+
+  // An address unique to the calling thread.
+  static const void *ThreadTag() {
+    static thread_local char tag;
+    return &tag;
+  }
+
+  Slot slots_[kSlots];
+  std::vector<std::pair<void *, Deleter>> retired_;
+};
+
+// Holds a read-side critical section of an EpochManager for its lifetime.
+class EpochGuard {
+ public:
+  explicit EpochGuard(EpochManager *epoch) : epoch_(epoch), slot_(epoch->Enter()) {}
+  ~EpochGuard() { epoch_->Exit(slot_); }
+
+  EpochGuard(const EpochGuard &) = delete;
+  EpochGuard &operator=(const EpochGuard &) = delete;
+
+ private:
+  EpochManager *const epoch_;
+  const size_t slot_;
+};
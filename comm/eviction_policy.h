@@ -0,0 +1,630 @@
+#pragma once
+#include <assert.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "lite_hash.h"
+
+// Whether a client holds a handle to e besides the cache's own reference.
+// refs is read atomically since lock-free hits raise it without the lock.
+inline bool IsPinned(const LRUHandle *e) {
+  return __atomic_load_n(&e->refs, __ATOMIC_RELAXED) > 1;
+}
+
+// Appends the entries of a random bucket of a shard's table to *out; see
+// HandleTable::SampleBucket().
+typedef void (*BucketSampler)(const void *table, uint32_t r, std::vector<LRUHandle *> *out);
+
+// Decides which entry of a cache shard is evicted next. A shard owns one
+// policy and calls it with the shard lock held:
+//   Insert(e)  after e was added to the cache,
+//   Touch(e)   when a Lookup hits e,
+//   Erase(e)   when e leaves the cache for any reason,
+//   Pin(e)     when a client pins e, which was not pinned before,
+//   Unpin(e)   when the last client releases e,
+//   Victim()   for the next entry to evict; the shard then erases it.
+//   Entries()  to list the unpinned entries, e.g. for a snapshot.
+// Policies keep their order in LRUHandle::next_/prev and per-entry state in
+// LRUHandle::policy_bits. Like the in_use_ list of the original cache, the
+// shard keeps pinned entries off the eviction order: Pin() unlinks e and
+// Unpin() links it back in as recently used, so Victim() never has to skip
+// them. Touch() and Erase() may see pinned entries (IsPinned(e)); they must
+// only update the entry's state then, not links. Victim() returns nullptr
+// when nothing can be evicted.
+//
+// A policy whose hits must not move entries can instead keep pinned entries
+// in place (pins_in_place()). The shard then never calls Pin() or Unpin(),
+// Erase() always unlinks, and Victim() has to step over pinned entries.
+// CLOCK and sampled LRU always do; the others switch over on
+// SetPinsInPlace(), which a shard needs once clients can pin entries
+// without its lock.
+class EvictionPolicy {
+ public:
+  virtual ~EvictionPolicy() {}
+
+  bool pins_in_place() const { return pins_in_place_; }
+
+  // Must be called before the first Insert().
+  void SetPinsInPlace() { pins_in_place_ = true; }
+
+  virtual void SetCapacity(size_t capacity) { (void)capacity; }
+
+  // Gives the policy a way to sample the shard's table, which is passed
+  // back to sampler as is. Only sampling policies use it.
+  virtual void SetSampler(BucketSampler sampler, const void *table) {
+    (void)sampler;
+    (void)table;
+  }
+
+  virtual void Insert(LRUHandle *e) = 0;
+  virtual void Touch(LRUHandle *e) = 0;
+  virtual void Erase(LRUHandle *e) = 0;
+  virtual void Pin(LRUHandle *e) = 0;
+  virtual void Unpin(LRUHandle *e) = 0;
+  virtual LRUHandle *Victim() = 0;
+
+  // Appends every entry on the policy's order to *out, roughly in the order
+  // Victim() would pick them, so the hottest entries come last. Pinned
+  // entries are on it only if pins_in_place().
+  virtual void Entries(std::vector<LRUHandle *> *out) const = 0;
+
+ protected:
+  explicit EvictionPolicy(bool pins_in_place = false) : pins_in_place_(pins_in_place) {}
+
+ private:
+  bool pins_in_place_;
+};
+
+enum EvictionPolicyType {
+  kLRUEviction,       // strict LRU; every hit moves the entry
+  kClockEviction,     // CLOCK; a hit only sets a reference bit
+  kTwoQueueEviction,  // segmented LRU: probation + protected
+  kTinyLFUEviction,   // W-TinyLFU: LRU window, frequency-gated segmented LRU
+  kSampledEviction,   // approximate LRU: oldest of a few sampled entries
+};
+
+// Circular doubly linked list through next_/prev with a dummy head,
+// oldest entry first, that also sums the charge of its entries.
+struct LRUList {
+  LRUHandle head;
+  size_t charge;
+
+  LRUList() : charge(0) {
+    head.next_ = &head;
+    head.prev = &head;
+  }
+
+  bool empty() const { return head.next_ == &head; }
+
+  // Makes e the newest entry.
+  void Append(LRUHandle *e) {
+    e->next_ = &head;
+    e->prev = head.prev;
+    e->prev->next_ = e;
+    e->next_->prev = e;
+    charge += e->charge;
+  }
+
+  void Remove(LRUHandle *e) {
+    e->next_->prev = e->prev;
+    e->prev->next_ = e->next_;
+    charge -= e->charge;
+  }
+
+  void AppendTo(std::vector<LRUHandle *> *out) const {
+    for (LRUHandle *e = head.next_; e != &head; e = e->next_) {
+      out->push_back(e);
+    }
+  }
+
+  // Oldest unpinned entry, or nullptr if there is none. Only policies that
+  // pin in place have pinned entries on their lists; for the others this
+  // is the first entry.
+  LRUHandle *Oldest() {
+    for (LRUHandle *e = head.next_; e != &head; e = e->next_) {
+      if (!IsPinned(e)) {
+        return e;
+      }
+    }
+    return nullptr;
+  }
+};
+
+class LRUPolicy : public EvictionPolicy {
+ public:
+  void Insert(LRUHandle *e) override { list_.Append(e); }
+  // A pinned entry becomes the newest one in Unpin(), unless pinned in place.
+  void Touch(LRUHandle *e) override {
+    if (pins_in_place() || !IsPinned(e)) {
+      list_.Remove(e);
+      list_.Append(e);
+    }
+  }
+  void Erase(LRUHandle *e) override {
+    if (pins_in_place() || !IsPinned(e)) {
+      list_.Remove(e);
+    }
+  }
+  void Pin(LRUHandle *e) override { list_.Remove(e); }
+  void Unpin(LRUHandle *e) override { list_.Append(e); }
+  LRUHandle *Victim() override { return list_.Oldest(); }
+  void Entries(std::vector<LRUHandle *> *out) const override { list_.AppendTo(out); }
+
+ private:
+  LRUList list_;
+};
+
+// Entries sit on a ring that a hand sweeps. A hit sets the entry's reference
+// bit and touches nothing else; the hand clears set bits and evicts the
+// first entry it finds clear. New entries go right behind the hand, so they
+// get a full sweep before they are considered. Pinned entries stay on the
+// ring, so pinning is free too; the hand passes them without clearing
+// their bit.
+class ClockPolicy : public EvictionPolicy {
+ public:
+  ClockPolicy() : EvictionPolicy(/*pins_in_place=*/true), hand_(&ring_.head), size_(0) {}
+
+  void Insert(LRUHandle *e) override {
+    e->policy_bits = 0;
+    InsertBefore(hand_, e);
+    size_++;
+  }
+  void Touch(LRUHandle *e) override { e->policy_bits = kReferenced; }
+  void Erase(LRUHandle *e) override { Unlink(e); }
+  void Pin(LRUHandle *e) override { (void)e; }
+  void Unpin(LRUHandle *e) override { (void)e; }
+
+  LRUHandle *Victim() override {
+    // Two sweeps clear every reference bit.
+    for (size_t steps = 0; steps < 2 * (size_ + 1); steps++) {
+      if (hand_ == &ring_.head) {
+        hand_ = hand_->next_;
+        continue;
+      }
+      LRUHandle *e = hand_;
+      hand_ = e->next_;
+      if (IsPinned(e)) {
+        continue;
+      }
+      if (e->policy_bits & kReferenced) {
+        e->policy_bits &= ~kReferenced;
+        continue;
+      }
+      return e;
+    }
+    return nullptr;
+  }
+
+  // Ring order starting at the hand.
+  void Entries(std::vector<LRUHandle *> *out) const override {
+    const LRUHandle *head = &ring_.head;
+    for (LRUHandle *e = hand_; e != head; e = e->next_) {
+      out->push_back(e);
+    }
+    for (LRUHandle *e = head->next_; e != hand_; e = e->next_) {
+      out->push_back(e);
+    }
+  }
+
+ private:
+  static const uint8_t kReferenced = 1;
+
+  void Unlink(LRUHandle *e) {
+    if (hand_ == e) {
+      hand_ = e->next_;
+    }
+    ring_.Remove(e);
+    size_--;
+  }
+
+  void InsertBefore(LRUHandle *pos, LRUHandle *e) {
+    e->next_ = pos;
+    e->prev = pos->prev;
+    e->prev->next_ = e;
+    pos->prev = e;
+    ring_.charge += e->charge;
+  }
+
+  LRUList ring_;
+  LRUHandle *hand_;
+  size_t size_;
+};
+
+// Segmented LRU. New entries start on probation; a second hit promotes them
+// to the protected segment, which holds at most kProtectedPercent of the
+// capacity and demotes its oldest entries back to probation. A scan only
+// ever fills probation, so it cannot flush the protected working set.
+class TwoQueuePolicy : public EvictionPolicy {
+ public:
+  static const size_t kProtectedPercent = 80;
+
+  TwoQueuePolicy() : protected_capacity_(0) {}
+
+  void SetCapacity(size_t capacity) override {
+    protected_capacity_ = capacity * kProtectedPercent / 100;
+  }
+
+  void Insert(LRUHandle *e) override {
+    e->policy_bits = kProbation;
+    probation_.Append(e);
+  }
+
+  // A pinned entry is only marked; Unpin() moves it. Entries pinned in
+  // place move right away.
+  void Touch(LRUHandle *e) override {
+    if (!pins_in_place() && IsPinned(e)) {
+      e->policy_bits = kProtected;
+      return;
+    }
+    List(e)->Remove(e);
+    e->policy_bits = kProtected;
+    protected_.Append(e);
+    DemoteOverflow();
+  }
+
+  void Erase(LRUHandle *e) override {
+    if (pins_in_place() || !IsPinned(e)) {
+      List(e)->Remove(e);
+    }
+  }
+  void Pin(LRUHandle *e) override { List(e)->Remove(e); }
+  void Unpin(LRUHandle *e) override {
+    List(e)->Append(e);
+    DemoteOverflow();
+  }
+
+  LRUHandle *Victim() override {
+    LRUHandle *e = probation_.Oldest();
+    return e != nullptr ? e : protected_.Oldest();
+  }
+
+  void Entries(std::vector<LRUHandle *> *out) const override {
+    probation_.AppendTo(out);
+    protected_.AppendTo(out);
+  }
+
+ private:
+  enum { kProbation = 0, kProtected = 1 };
+
+  LRUList *List(LRUHandle *e) { return e->policy_bits == kProbation ? &probation_ : &protected_; }
+
+  void DemoteOverflow() {
+    while (protected_.charge > protected_capacity_ && !protected_.empty()) {
+      LRUHandle *old = protected_.head.next_;
+      protected_.Remove(old);
+      old->policy_bits = kProbation;
+      probation_.Append(old);
+    }
+  }
+
+  size_t protected_capacity_;
+  LRUList probation_;
+  LRUList protected_;
+};
+
+// Count-min sketch of recent key frequencies: four rows of 4-bit saturating
+// counters, two per byte. Every kResetMultiplier * width increments all
+// counters are halved so that old popularity fades.
+class FrequencySketch {
+ public:
+  static const size_t kResetMultiplier = 10;
+
+  FrequencySketch() : mask_(0), additions_(0) { Resize(64); }
+
+  // Grows the sketch to cover about n distinct keys. Drops recorded counts.
+  void EnsureCapacity(size_t n) {
+    if (n > mask_ + 1) {
+      size_t width = mask_ + 1;
+      while (width < n) {
+        width *= 2;
+      }
+      Resize(width);
+    }
+  }
+
+  void Increment(uint32_t hash) {
+    bool added = false;
+    for (int i = 0; i < 4; i++) {
+      size_t idx = Index(hash, i);
+      uint8_t &b = table_[i][idx >> 1];
+      int shift = (idx & 1) * 4;
+      if (((b >> shift) & 0xf) < 15) {
+        b += static_cast<uint8_t>(1 << shift);
+        added = true;
+      }
+    }
+    if (added && ++additions_ >= kResetMultiplier * (mask_ + 1)) {
+      Reset();
+    }
+  }
+
+  int Frequency(uint32_t hash) const {
+    int f = 15;
+    for (int i = 0; i < 4; i++) {
+      size_t idx = Index(hash, i);
+      int c = (table_[i][idx >> 1] >> ((idx & 1) * 4)) & 0xf;
+      f = c < f ? c : f;
+    }
+    return f;
+  }
+
+ private:
+  size_t Index(uint32_t hash, int row) const {
+    static const uint64_t kSeeds[4] = {0xc3a5c85c97cb3127ull, 0xb492b66fbe98f273ull,
+                                       0x9ae16a3b2f90404full, 0xcbf29ce484222325ull};
+    uint64_t x = (hash + kSeeds[row]) * 0x9e3779b97f4a7c15ull;
+    return static_cast<size_t>(x ^ (x >> 32)) & mask_;
+  }
+
+  void Resize(size_t width) {
+    mask_ = width - 1;
+    for (int i = 0; i < 4; i++) {
+      table_[i].assign((width + 1) / 2, 0);
+    }
+    additions_ = 0;
+  }
+
+  void Reset() {
+    for (int i = 0; i < 4; i++) {
+      for (size_t j = 0; j < table_[i].size(); j++) {
+        table_[i][j] = (table_[i][j] >> 1) & 0x77;
+      }
+    }
+    additions_ /= 2;
+  }
+
+  size_t mask_;
+  size_t additions_;
+  std::vector<uint8_t> table_[4];
+};
+
+// W-TinyLFU. New entries enter a small LRU window (kWindowPercent of the
+// capacity). When the window overflows, its oldest entry becomes a
+// candidate for the main segmented LRU; if main is full, the candidate is
+// only admitted if the sketch has seen its key more often than the key of
+// main's next victim, otherwise the candidate itself is evicted. One-hit
+// wonders from a scan therefore die in the window.
+class TinyLFUPolicy : public EvictionPolicy {
+ public:
+  static const size_t kWindowPercent = 1;
+  static const size_t kProtectedPercent = 80;
+
+  TinyLFUPolicy() : window_capacity_(0), main_capacity_(0), protected_capacity_(0), size_(0) {}
+
+  void SetCapacity(size_t capacity) override {
+    window_capacity_ = capacity * kWindowPercent / 100;
+    main_capacity_ = capacity - window_capacity_;
+    protected_capacity_ = main_capacity_ * kProtectedPercent / 100;
+  }
+
+  void Insert(LRUHandle *e) override {
+    sketch_.EnsureCapacity(++size_);
+    sketch_.Increment(e->hash);
+    e->policy_bits = kWindow;
+    window_.Append(e);
+  }
+
+  // A pinned entry is only counted and marked; Unpin() moves it. Entries
+  // pinned in place move right away.
+  void Touch(LRUHandle *e) override {
+    sketch_.Increment(e->hash);
+    if (!pins_in_place() && IsPinned(e)) {
+      if (e->policy_bits == kProbation) {
+        e->policy_bits = kProtected;
+      }
+      return;
+    }
+    List(e)->Remove(e);
+    if (e->policy_bits == kProbation) {
+      e->policy_bits = kProtected;
+    }
+    List(e)->Append(e);
+    DemoteOverflow();
+  }
+
+  void Erase(LRUHandle *e) override {
+    if (pins_in_place() || !IsPinned(e)) {
+      List(e)->Remove(e);
+    }
+    size_--;
+  }
+  void Pin(LRUHandle *e) override { List(e)->Remove(e); }
+  void Unpin(LRUHandle *e) override {
+    List(e)->Append(e);
+    DemoteOverflow();
+  }
+
+  LRUHandle *Victim() override {
+    while (window_.charge > window_capacity_) {
+      LRUHandle *candidate = window_.Oldest();
+      if (candidate == nullptr) {
+        break;
+      }
+      if (MainCharge() + candidate->charge <= main_capacity_) {
+        Admit(candidate);
+        continue;
+      }
+      LRUHandle *victim = MainVictim();
+      if (victim == nullptr) {
+        return candidate;
+      }
+      if (sketch_.Frequency(candidate->hash) > sketch_.Frequency(victim->hash)) {
+        Admit(candidate);
+        return victim;
+      }
+      return candidate;
+    }
+    LRUHandle *e = MainVictim();
+    return e != nullptr ? e : window_.Oldest();
+  }
+
+  // The window holds the newest entries, but only protected ones have
+  // proven themselves, so they go last.
+  void Entries(std::vector<LRUHandle *> *out) const override {
+    probation_.AppendTo(out);
+    window_.AppendTo(out);
+    protected_.AppendTo(out);
+  }
+
+ private:
+  enum { kWindow = 0, kProbation = 1, kProtected = 2 };
+
+  LRUList *List(LRUHandle *e) {
+    switch (e->policy_bits) {
+      case kWindow:
+        return &window_;
+      case kProbation:
+        return &probation_;
+      default:
+        return &protected_;
+    }
+  }
+
+  size_t MainCharge() const { return probation_.charge + protected_.charge; }
+
+  void DemoteOverflow() {
+    while (protected_.charge > protected_capacity_ && !protected_.empty()) {
+      LRUHandle *old = protected_.head.next_;
+      protected_.Remove(old);
+      old->policy_bits = kProbation;
+      probation_.Append(old);
+    }
+  }
+
+  LRUHandle *MainVictim() {
+    LRUHandle *e = probation_.Oldest();
+    return e != nullptr ? e : protected_.Oldest();
+  }
+
+  void Admit(LRUHandle *e) {
+    window_.Remove(e);
+    e->policy_bits = kProbation;
+    probation_.Append(e);
+  }
+
+  size_t window_capacity_;
+  size_t main_capacity_;
+  size_t protected_capacity_;
+  size_t size_;
+  FrequencySketch sketch_;
+  LRUList window_;
+  LRUList probation_;
+  LRUList protected_;
+};
+
+// Approximate LRU in the style of Redis. Every entry records in
+// access_time the value of a logical clock that counts inserts, when it is
+// inserted and again on every hit. Victim() samples the table through the
+// shard's BucketSampler until it has seen kSamples entries and evicts the
+// one that was accessed longest ago. Entries also sit on a list in
+// insertion order, which serves Entries() and is the fallback when a
+// sample is all pinned.
+//
+// Pinned entries stay on that list (pins_in_place()), so the policy's part
+// of a hit is one relaxed store to access_time and no link is written. The
+// shard still takes its lock around a hit for the table probe and the
+// reference count; only Touch() itself would be safe without it.
+class SampledLRUPolicy : public EvictionPolicy {
+ public:
+  static const size_t kSamples = 8;
+  // Bound on buckets probed per Victim(), empty ones included.
+  static const int kMaxProbes = 4 * kSamples;
+
+  SampledLRUPolicy()
+      : EvictionPolicy(/*pins_in_place=*/true),
+        sampler_(nullptr),
+        table_(nullptr),
+        clock_(0),
+        seed_(0x9e3779b9u) {}
+
+  void SetSampler(BucketSampler sampler, const void *table) override {
+    sampler_ = sampler;
+    table_ = table;
+  }
+
+  void Insert(LRUHandle *e) override {
+    const uint32_t now = __atomic_load_n(&clock_, __ATOMIC_RELAXED);
+    __atomic_store_n(&clock_, now + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->access_time, now, __ATOMIC_RELAXED);
+    list_.Append(e);
+  }
+  void Touch(LRUHandle *e) override {
+    __atomic_store_n(&e->access_time, __atomic_load_n(&clock_, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+  }
+  void Erase(LRUHandle *e) override { list_.Remove(e); }
+  void Pin(LRUHandle *e) override { (void)e; }
+  void Unpin(LRUHandle *e) override { (void)e; }
+
+  LRUHandle *Victim() override {
+    if (list_.empty()) {
+      return nullptr;
+    }
+    LRUHandle *victim = nullptr;
+    if (sampler_ != nullptr) {
+      size_t seen = 0;
+      for (int i = 0; i < kMaxProbes && seen < kSamples; i++) {
+        sample_.clear();
+        (*sampler_)(table_, NextRandom(), &sample_);
+        seen += sample_.size();
+        for (size_t j = 0; j < sample_.size(); j++) {
+          LRUHandle *e = sample_[j];
+          if (!IsPinned(e) && (victim == nullptr || Age(e) > Age(victim))) {
+            victim = e;
+          }
+        }
+      }
+    }
+    return victim != nullptr ? victim : list_.Oldest();
+  }
+
+  // Least recently accessed first.
+  void Entries(std::vector<LRUHandle *> *out) const override {
+    const size_t start = out->size();
+    list_.AppendTo(out);
+    const SampledLRUPolicy *self = this;
+    std::stable_sort(out->begin() + start, out->end(),
+                     [self](LRUHandle *a, LRUHandle *b) { return self->Age(a) > self->Age(b); });
+  }
+
+ private:
+  // Inserts since e was last accessed; correct across clock wrap-around.
+  uint32_t Age(const LRUHandle *e) const {
+    return __atomic_load_n(&clock_, __ATOMIC_RELAXED) -
+           __atomic_load_n(&e->access_time, __ATOMIC_RELAXED);
+  }
+
+  // xorshift32
+  uint32_t NextRandom() {
+    seed_ ^= seed_ << 13;
+    seed_ ^= seed_ >> 17;
+    seed_ ^= seed_ << 5;
+    return seed_;
+  }
+
+  BucketSampler sampler_;
+  const void *table_;
+  uint32_t clock_;  // inserts so far; read by Touch(), accessed atomically
+  uint32_t seed_;
+  LRUList list_;
+  std::vector<LRUHandle *> sample_;
+};
+
+inline EvictionPolicy *NewEvictionPolicy(EvictionPolicyType type) {
+  switch (type) {
+    case kClockEviction:
+      return new ClockPolicy;
+    case kTwoQueueEviction:
+      return new TwoQueuePolicy;
+    case kTinyLFUEviction:
+      return new TinyLFUPolicy;
+    case kSampledEviction:
+      return new SampledLRUPolicy;
+    default:
+      return new LRUPolicy;
+  }
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <assert.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+// Memory for the LRUHandles of one cache shard, together with their inline
+// keys. Follows the node allocator of stl_v1/stl_alloc.h: requests up to
+// kMaxBytes are rounded up to a multiple of kAlign and served from one free
+// list per size class, which is refilled kRefillObjects at a time from
+// kPageSize pages obtained with malloc. A freed handle goes back onto its
+// list and is reused by the next insert of a similar key length, so a shard
+// whose working set has settled no longer calls malloc or free. Larger
+// requests go straight to malloc.
+//
+// Pages are only returned to malloc by the destructor. Not thread-safe; the
+// shard lock covers it.
+class HandleSlab {
+ public:
+  static const size_t kAlign = 16;
+  static const size_t kMaxBytes = 512;
+  static const size_t kNumClasses = kMaxBytes / kAlign;
+  static const size_t kPageSize = 64 << 10;
+  static const int kRefillObjects = 32;
+
+  HandleSlab() : page_start_(nullptr), page_end_(nullptr), page_bytes_(0) {
+    for (size_t i = 0; i < kNumClasses; i++) {
+      free_list_[i] = nullptr;
+    }
+  }
+
+  ~HandleSlab() {
+    for (size_t i = 0; i < pages_.size(); i++) {
+      free(pages_[i]);
+    }
+  }
+
+  HandleSlab(const HandleSlab &) = delete;
+  HandleSlab &operator=(const HandleSlab &) = delete;
+
+  // Returns nullptr if malloc fails.
+  void *Allocate(size_t n) {
+    if (n > kMaxBytes) {
+      return malloc(n);
+    }
+    Obj **list = &free_list_[ClassIndex(n)];
+    Obj *result = *list;
+    if (result == nullptr) {
+      return Refill(RoundUp(n));
+    }
+    *list = result->next;
+    return result;
+  }
+
+  // n must be the size passed to Allocate().
+  void Free(void *p, size_t n) {
+    if (n > kMaxBytes) {
+      free(p);
+      return;
+    }
+    Obj *q = static_cast<Obj *>(p);
+    Obj **list = &free_list_[ClassIndex(n)];
+    q->next = *list;
+    *list = q;
+  }
+
+  // Bytes held in pages, whether in use or on a free list.
+  size_t page_bytes() const { return page_bytes_; }
+
+ private:
+  union Obj {
+    Obj *next;
+    char data[1];
+  };
+
+  static size_t RoundUp(size_t n) { return (n + kAlign - 1) & ~(kAlign - 1); }
+  static size_t ClassIndex(size_t n) { return (n + kAlign - 1) / kAlign - 1; }
+
+  // Returns one object of size n and puts the rest of a fresh batch of
+  // them on the free list of n.
+  void *Refill(size_t n) {
+    int nobjs = kRefillObjects;
+    char *chunk = CarveChunk(n, &nobjs);
+    if (chunk == nullptr) {
+      return nullptr;
+    }
+    Obj **list = &free_list_[ClassIndex(n)];
+    for (int i = nobjs - 1; i >= 1; i--) {
+      Obj *o = reinterpret_cast<Obj *>(chunk + i * n);
+      o->next = *list;
+      *list = o;
+    }
+    return chunk;
+  }
+
+  // Takes *nobjs objects of size n from the current page, fewer if only
+  // that many fit, starting a new page if not even one does. Returns
+  // nullptr if that page cannot be allocated.
+  char *CarveChunk(size_t n, int *nobjs) {
+    size_t left = page_end_ - page_start_;
+    if (left < n) {
+      char *page = static_cast<char *>(malloc(kPageSize));
+      if (page == nullptr) {
+        return nullptr;
+      }
+      if (left > 0) {
+        // Page tails are multiples of kAlign, so they always fit a class.
+        Free(page_start_, left);
+      }
+      page_start_ = page;
+      page_end_ = page_start_ + kPageSize;
+      page_bytes_ += kPageSize;
+      pages_.push_back(page_start_);
+      left = kPageSize;
+    }
+    if (left < n * *nobjs) {
+      *nobjs = static_cast<int>(left / n);
+    }
+    char *result = page_start_;
+    page_start_ += n * *nobjs;
+    return result;
+  }
+
+  Obj *free_list_[kNumClasses];
+  char *page_start_;  // unused rest of the newest page
+  char *page_end_;
+  size_t page_bytes_;
+  std::vector<char *> pages_;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "slice.h"
+
+// Fast non-cryptographic hashing for HandleTable keys.
+//
+// Keys up to kHashLongKey bytes use the wyhash construction: 64x64->128 bit
+// multiplies folded back to 64 bits, three independent lanes for keys over
+// 48 bytes. Longer keys are first folded 64 bytes at a time into eight
+// 64-bit accumulators (32x32->64 multiply-accumulate, SSE2 when available),
+// which keeps the bulk of a long key off the multiplier's critical path.
+//
+// Every input bit affects every output bit, so both the low bits
+// (HandleTable buckets) and the high bits (cache shards) of Hash32 are
+// usable. Values are not stable across releases or byte orders; never
+// persist them.
+
+static const uint64_t kHashSecret[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+                                        0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+static const size_t kHashLongKey = 256;
+
+inline void HashMum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 r = *a;
+  r *= *b;
+  *a = static_cast<uint64_t>(r);
+  *b = static_cast<uint64_t>(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  *a = lo;
+  *b = hi;
+#endif
+}
+
+inline uint64_t HashMix(uint64_t a, uint64_t b) {
+  HashMum(&a, &b);
+  return a ^ b;
+}
+
+inline uint64_t HashRead64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t HashRead32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Folds the 64-byte stripes of p[0, *len) into a seed and advances p and
+// *len past them. Stripe s is keyed with kHashSecret-derived lane keys plus
+// s * step so that reordering stripes changes the result.
+inline uint64_t HashLongStripes(const uint8_t **p, size_t *len, uint64_t seed) {
+  static const uint64_t kStep = 0x9e3779b97f4a7c15ull;
+  static const uint64_t kPrime32 = 0x9e3779b1ull;
+  uint64_t key[8];
+  uint64_t acc[8];
+  for (int j = 0; j < 8; j++) {
+    key[j] = kHashSecret[j & 3] ^ (seed + j * kStep);
+    acc[j] = kHashSecret[(j + 1) & 3];
+  }
+  const uint8_t *q = *p;
+  size_t stripes = (*len - 1) / 64;  // leave 1..64 bytes for the tail
+  for (size_t s = 0; s < stripes; s++, q += 64) {
+#if defined(__SSE2__)
+    for (int j = 0; j < 8; j += 2) {
+      __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(q + j * 8));
+      __m128i k = _mm_xor_si128(d, _mm_loadu_si128(reinterpret_cast<const __m128i *>(key + j)));
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + j));
+      // lo32(k) * hi32(k) per lane, plus the data of the neighbouring lane.
+      __m128i prod = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+      a = _mm_add_epi64(a, _mm_add_epi64(prod, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(acc + j), a);
+    }
+#else
+    for (int j = 0; j < 8; j++) {
+      uint64_t d = HashRead64(q + j * 8);
+      uint64_t k = d ^ key[j];
+      acc[j] += (k & 0xffffffffu) * (k >> 32) + HashRead64(q + (j ^ 1) * 8);
+    }
+#endif
+    for (int j = 0; j < 8; j++) {
+      key[j] += kStep;
+    }
+    if ((s & 15) == 15) {
+      for (int j = 0; j < 8; j++) {
+        acc[j] = (acc[j] ^ (acc[j] >> 47) ^ kHashSecret[j & 3]) * kPrime32;
+      }
+    }
+  }
+  *p = q;
+  *len -= stripes * 64;
+  uint64_t h = seed ^ (stripes * 64);
+  for (int j = 0; j < 8; j += 2) {
+    h = HashMix(acc[j] ^ kHashSecret[1], acc[j + 1] ^ h);
+  }
+  return h;
+}
+
+inline uint64_t Hash64(const char *data, size_t n, uint64_t seed = 0) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+  const size_t len = n;
+  seed ^= HashMix(seed ^ kHashSecret[0], kHashSecret[1]);
+  uint64_t a, b;
+  if (n <= 16) {
+    if (n >= 4) {
+      a = (HashRead32(p) << 32) | HashRead32(p + ((n >> 3) << 2));
+      b = (HashRead32(p + n - 4) << 32) | HashRead32(p + n - 4 - ((n >> 3) << 2));
+    } else if (n > 0) {
+      a = (uint64_t(p[0]) << 16) | (uint64_t(p[n >> 1]) << 8) | p[n - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (n > kHashLongKey) {
+      seed = HashLongStripes(&p, &n, seed);
+    }
+    if (n > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = HashMix(HashRead64(p) ^ kHashSecret[1], HashRead64(p + 8) ^ seed);
+        see1 = HashMix(HashRead64(p + 16) ^ kHashSecret[2], HashRead64(p + 24) ^ see1);
+        see2 = HashMix(HashRead64(p + 32) ^ kHashSecret[3], HashRead64(p + 40) ^ see2);
+        p += 48;
+        n -= 48;
+      } while (n > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (n > 16) {
+      seed = HashMix(HashRead64(p) ^ kHashSecret[1], HashRead64(p + 8) ^ seed);
+      n -= 16;
+      p += 16;
+    }
+    // The key had more than 16 bytes, so reading the last 16 is in bounds
+    // even if it overlaps bytes hashed above.
+    a = HashRead64(p + n - 16);
+    b = HashRead64(p + n - 8);
+  }
+  a ^= kHashSecret[1];
+  b ^= seed;
+  HashMum(&a, &b);
+  return HashMix(a ^ kHashSecret[0] ^ len, b ^ kHashSecret[1]);
+}
+
+inline uint32_t Hash32(const char *data, size_t n, uint32_t seed = 0) {
+  uint64_t h = Hash64(data, n, seed);
+  return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+inline uint64_t Hash64(const Slice &key) { return Hash64(key.data(), key.size()); }
+inline uint32_t Hash32(const Slice &key) { return Hash32(key.data(), key.size()); }
@@ -0,0 +1,147 @@
+#pragma once
+#include <assert.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "epoch.h"
+#include "lite_hash.h"
+#include "slice.h"
+
+// Lock-free lookup side of a cache shard, for hits that skip the shard
+// lock. A set-associative array of handle pointers: a key maps to one
+// bucket of kWays slots, and Add() overwrites a slot when the bucket is
+// full. The index need not hold every entry of the shard, since a reader
+// that misses here retries under the lock; all it owes readers is never to
+// return a handle that has been freed.
+//
+// Writers are serialized by the shard lock. Readers run inside a critical
+// section of the EpochManager passed to the constructor, and a handle may
+// only be freed a grace period after its Remove(). Bucket arrays replaced
+// by growing are freed the same way, right here, so readers must never
+// wait for the shard lock while inside a critical section. The index grows
+// with the shard but never shrinks.
+class HitIndex {
+ public:
+  static const uint32_t kWays = 4;
+
+  explicit HitIndex(EpochManager *epoch) : epoch_(epoch), elems_(0) {
+    initial_.length = kMinLength;
+    initial_.heap = false;
+    memset(initial_.slot, 0, sizeof(initial_.slot));
+    buckets_.store(&initial_, std::memory_order_relaxed);
+  }
+  ~HitIndex() { FreeBuckets(buckets_.load(std::memory_order_relaxed)); }
+
+  HitIndex(const HitIndex &) = delete;
+  HitIndex &operator=(const HitIndex &) = delete;
+
+  // Lock-free. Must be called inside a critical section of the epoch; the
+  // result may be dereferenced until it ends, but is not pinned.
+  LRUHandle *Lookup(const Slice &key, uint32_t hash) const {
+    const BucketArray *b = buckets_.load(std::memory_order_acquire);
+    LRUHandle *const *slot = &b->slot[(hash & (b->length - 1)) * kWays];
+    for (uint32_t i = 0; i < kWays; i++) {
+      LRUHandle *h = __atomic_load_n(&slot[i], __ATOMIC_ACQUIRE);
+      // Not h->key(): its debug check reads next_, which the lock guards.
+      if (h != nullptr && h->hash == hash && key == Slice(h->key_data, h->key_length)) {
+        return h;
+      }
+    }
+    return nullptr;
+  }
+
+  // e must be fully initialized; readers may find it as soon as this
+  // returns, or sooner.
+  void Add(LRUHandle *e) {
+    BucketArray *b = buckets_.load(std::memory_order_relaxed);
+    if (elems_ >= b->length * kWays / 2) {
+      b = Grow(b);
+    }
+    Place(b, e);
+  }
+
+  void Remove(LRUHandle *e) {
+    BucketArray *b = buckets_.load(std::memory_order_relaxed);
+    LRUHandle **slot = &b->slot[(e->hash & (b->length - 1)) * kWays];
+    for (uint32_t i = 0; i < kWays; i++) {
+      if (slot[i] == e) {
+        __atomic_store_n(&slot[i], nullptr, __ATOMIC_RELEASE);
+        elems_--;
+        return;
+      }
+    }
+  }
+
+ private:
+  static const uint32_t kMinLength = 4;
+
+  // Longer arrays are allocated with room for the rest of slot[]; bucket i
+  // is slot[i * kWays, (i + 1) * kWays).
+  struct BucketArray {
+    uint32_t length;
+    bool heap;  // false for initial_
+    LRUHandle *slot[kMinLength * kWays];
+  };
+
+  // Returns nullptr if out of memory.
+  static BucketArray *NewBuckets(uint32_t length) {
+    size_t bytes =
+        sizeof(BucketArray) + sizeof(LRUHandle *) * (length - kMinLength) * size_t{kWays};
+    BucketArray *b = static_cast<BucketArray *>(malloc(bytes));
+    if (b == nullptr) {
+      return nullptr;
+    }
+    b->length = length;
+    b->heap = true;
+    memset(b->slot, 0, sizeof(LRUHandle *) * length * size_t{kWays});
+    return b;
+  }
+
+  static void FreeBuckets(BucketArray *b) {
+    if (b->heap) {
+      free(b);
+    }
+  }
+
+  // Puts e in a free slot of its bucket, or over the slot its hash picks.
+  void Place(BucketArray *b, LRUHandle *e) {
+    LRUHandle **slot = &b->slot[(e->hash & (b->length - 1)) * kWays];
+    uint32_t way = (e->hash >> 16) & (kWays - 1);
+    for (uint32_t i = 0; i < kWays; i++) {
+      if (slot[i] == nullptr) {
+        way = i;
+        elems_++;
+        break;
+      }
+    }
+    __atomic_store_n(&slot[way], e, __ATOMIC_RELEASE);
+  }
+
+  // Doubles the bucket count and returns the new array, or b if out of
+  // memory. Entries that no longer fit their bucket are dropped.
+  BucketArray *Grow(BucketArray *b) {
+    BucketArray *grown = NewBuckets(b->length * 2);
+    if (grown == nullptr) {
+      return b;
+    }
+    elems_ = 0;
+    for (uint32_t i = 0; i < b->length * kWays; i++) {
+      if (b->slot[i] != nullptr) {
+        Place(grown, b->slot[i]);
+      }
+    }
+    buckets_.store(grown, std::memory_order_release);
+    epoch_->Synchronize();
+    FreeBuckets(b);
+    return grown;
+  }
+
+  EpochManager *const epoch_;
+  uint32_t elems_;  // occupied slots
+  std::atomic<BucketArray *> buckets_;
+  BucketArray initial_;
+};
@@ -5,81 +5,450 @@
 #include <cstdint>
 #include <cstring>
 #include <string>
+#include <type_traits>
+#include <vector>
+
+#include "cache_stats.h"
+#include "hash.h"
+#include "slice.h"
+
+// Called with an entry's key and value once the entry is destroyed. The key
+// is only valid for the duration of the call.
+typedef void (*CacheDeleter)(const Slice &key, void *value);
+
+struct LRUHandle;
+
+// TTL state of an entry, owned by the shard's TimingWheel. Only entries
+// inserted with a TTL have one, as a trailer after the key bytes, so the
+// others do not pay its 24 bytes.
+struct LRUHandleTimer {
+  uint64_t expire_at;
+  LRUHandle *next;
+  LRUHandle **pprev;  // nullptr while not scheduled
+};
+
+// An entry is a variable length heap-allocated structure: the key bytes are
+// stored right after the struct, so a handle and its key take a single
+// allocation of SizeOf(key_length) bytes and comparing keys touches no
+// other memory.
 struct LRUHandle {
   void *value;
-  void (*deleter)(const std::string, void *value);
+  CacheDeleter deleter;
   LRUHandle *next_hash;
   LRUHandle *next_;
   LRUHandle *prev;
   size_t charge;
   size_t key_length;
   bool in_cache;
+  uint8_t policy_bits;  // owned by the shard's EvictionPolicy
+  bool has_timer;       // allocated with SizeOf(key_length, true)
   uint32_t refs;
   uint32_t hash;
-  //   char key_data[1];
-  std::string key;
+  uint32_t access_time;  // owned by the shard's EvictionPolicy
+  char key_data[1];      // Beginning of key
+
+  Slice key() const {
+    // next_ is only equal to this if the LRU handle is the list head of an
+    // empty list. List heads never have meaningful keys.
+    assert(next_ != this);
+    return Slice(key_data, key_length);
+  }
+
+  // 0 for entries that never expire.
+  uint64_t expire_at() const { return has_timer ? timer()->expire_at : 0; }
+
+  LRUHandleTimer *timer() {
+    assert(has_timer);
+    return reinterpret_cast<LRUHandleTimer *>(reinterpret_cast<char *>(this) +
+                                              TimerOffset(key_length));
+  }
+  const LRUHandleTimer *timer() const { return const_cast<LRUHandle *>(this)->timer(); }
+
+  static size_t SizeOf(size_t key_length, bool has_timer = false) {
+    return has_timer ? TimerOffset(key_length) + sizeof(LRUHandleTimer)
+                     : sizeof(LRUHandle) - 1 + key_length;
+  }
+
+  static size_t TimerOffset(size_t key_length) {
+    return (sizeof(LRUHandle) - 1 + key_length + alignof(LRUHandleTimer) - 1) &
+           ~(alignof(LRUHandleTimer) - 1);
+  }
+};
+
+// Hash and equality of table keys. Slice keys use Hash32 and byte-wise
+// comparison; integer, enum and pointer keys a multiplicative mix whose
+// high product bits fill the whole 32-bit result, so both the low bits
+// (buckets) and the high bits (cache shards) are well distributed.
+template <class Key>
+struct HandleKeyHash {
+  uint32_t operator()(const Key &key) const {
+    uint64_t x = static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ull;
+    return static_cast<uint32_t>(x >> 32);
+  }
+};
+
+template <class Key>
+struct HandleKeyHash<Key *> {
+  uint32_t operator()(Key *key) const {
+    return HandleKeyHash<uintptr_t>()(reinterpret_cast<uintptr_t>(key));
+  }
+};
+
+template <>
+struct HandleKeyHash<Slice> {
+  uint32_t operator()(const Slice &key) const { return Hash32(key); }
+};
+
+template <class Key>
+struct HandleKeyEqual {
+  bool operator()(const Key &a, const Key &b) const { return a == b; }
+};
+
+// Keys that are cheap to copy and compare in a register. Tables over such
+// keys keep a copy of the key of each chain's first handle in the bucket
+// itself, so a lookup that hits the head of its chain, the common case at
+// a load factor of at most 1, never touches the handle. Specialize this for
+// small structs with a cheap operator== to opt them in.
+template <class Key>
+struct IsFixedWidthKey {
+  static const bool value =
+      std::is_integral<Key>::value || std::is_enum<Key>::value || std::is_pointer<Key>::value;
+};
+
+// Handle for tables keyed by a fixed-width Key, the counterpart of
+// LRUHandle for BasicHandleTable<FixedKeyHandle<Key>, Key>.
+template <class Key>
+struct FixedKeyHandle {
+  void *value;
+  FixedKeyHandle *next_hash;
+  uint32_t hash;
+  Key key_value;
+
+  const Key &key() const { return key_value; }
 };
 
-class HandleTable {
+// Chained hash table over handles that expose key(), hash and next_hash,
+// keyed by Key, hashed by Hasher and compared by Equal.
+//
+// The table grows once the load factor exceeds 1 and shrinks once it drops
+// below 1/4, to a length that leaves it half full; the gap between the two
+// thresholds keeps it from resizing back and forth around one size.
+//
+// With incremental_resize set, resizing does not rehash every chain at once.
+// The new bucket array is installed next to the old one and each
+// Insert/Lookup/Remove migrates at most kMigrateBuckets old buckets, so the
+// cost of a rehash is spread over the operations that follow it. Buckets of
+// old_list_ below migrated_ have already been moved into list_. Growing and
+// shrinking take the same path.
+template <class Handle, class Key = Slice, class Hasher = HandleKeyHash<Key>,
+          class Equal = HandleKeyEqual<Key>>
+class BasicHandleTable {
  public:
-  HandleTable() : length_(0), elems_(0), list_(nullptr) { Resize(); }
-  ~HandleTable() { delete[] list_; };
+  explicit BasicHandleTable(bool incremental_resize = false)
+      : incremental_(incremental_resize),
+        length_(0),
+        elems_(0),
+        list_(nullptr),
+        old_length_(0),
+        migrated_(0),
+        old_list_(nullptr) {
+    Resize(kMinLength);
+  }
+  ~BasicHandleTable() {
+    delete[] list_;
+    delete[] old_list_;
+  };
+
+  BasicHandleTable(const BasicHandleTable &) = delete;
+  BasicHandleTable &operator=(const BasicHandleTable &) = delete;
+
+  Handle *Lookup(const Key &key, uint32_t hash) {
+    MigrateBuckets(kMigrateBuckets);
+    uint32_t probes = 0;
+    Handle *result = *FindPointer(key, hash, &probes);
+    COMM_STATS_ADD(stats_.probe_histogram[ProbeHistogramBucket(probes)], 1);
+    return result;
+  }
+  Handle *Lookup(const Key &key) { return Lookup(key, Hasher()(key)); }
+
+  // Same as out[i] = Lookup(keys[i], hashes[i]) for i < n, but overlaps the
+  // cache misses of a batch of keys: all bucket slots are prefetched first,
+  // then all chain heads, and the chains are then walked one step per key
+  // per round so that each handle was prefetched a round before it is
+  // compared. With inline keys a head hit is resolved from the bucket.
+  void MultiLookup(size_t n, const Key *keys, const uint32_t *hashes, Handle **out) {
+    for (size_t start = 0; start < n; start += kMultiLookupBatch) {
+      const size_t m = n - start < kMultiLookupBatch ? n - start : kMultiLookupBatch;
+      const Key *k = keys + start;
+      const uint32_t *h = hashes + start;
+      Handle **o = out + start;
+      // Migration relinks chains, so it must not happen inside a batch.
+      MigrateBuckets(static_cast<uint32_t>(kMigrateBuckets * m));
 
-  LRUHandle *Lookup(const std::string &key, uint32_t hash) {
-    return *FindPointer(key, hash);
+      Bucket *bucket[kMultiLookupBatch];
+      Handle *cur[kMultiLookupBatch];
+      uint32_t probes[kMultiLookupBatch];
+      for (size_t i = 0; i < m; i++) {
+        bucket[i] = BucketFor(h[i]);
+        __builtin_prefetch(bucket[i]);
+      }
+      for (size_t i = 0; i < m; i++) {
+        cur[i] = bucket[i]->head;
+        probes[i] = 0;
+        if (cur[i] == nullptr) {
+          o[i] = nullptr;
+          COMM_STATS_ADD(stats_.probe_histogram[0], 1);
+        } else if (kInlineKey && bucket[i]->HeadIs(k[i])) {
+          o[i] = cur[i];
+          cur[i] = nullptr;
+          COMM_STATS_ADD(stats_.probe_histogram[0], 1);
+        }
+        PrefetchHandle(cur[i]);
+      }
+      size_t active = m;
+      while (active > 0) {
+        active = 0;
+        for (size_t i = 0; i < m; i++) {
+          Handle *e = cur[i];
+          if (e == nullptr) {
+            continue;
+          }
+          if (e->hash == h[i] && Equal()(k[i], e->key())) {
+            o[i] = e;
+            cur[i] = nullptr;
+            COMM_STATS_ADD(stats_.probe_histogram[ProbeHistogramBucket(probes[i])], 1);
+            continue;
+          }
+          cur[i] = e->next_hash;
+          probes[i]++;
+          if (cur[i] != nullptr) {
+            PrefetchHandle(cur[i]);
+            active++;
+          } else {
+            o[i] = nullptr;
+            COMM_STATS_ADD(stats_.probe_histogram[ProbeHistogramBucket(probes[i])], 1);
+          }
+        }
+      }
+    }
   }
 
-  LRUHandle *Insert(LRUHandle *h) {
-    LRUHandle **ptr = FindPointer(h->key, h->hash);
-    LRUHandle *old = *ptr;
+  Handle *Insert(Handle *h) {
+    MigrateBuckets(kMigrateBuckets);
+    Bucket *b = BucketFor(h->hash);
+    Handle **ptr = FindPointer(b, h->key(), h->hash);
+    Handle *old = *ptr;
     h->next_hash = (old == nullptr ? nullptr : old->next_hash);
     *ptr = h;
+    b->SyncKey();
     if (old == nullptr) {
       ++elems_;
-      if (elems_ > length_) {
-        Resize();
-      }
+      MaybeGrow();
     }
     return old;
   }
 
+  Handle *Remove(const Key &key, uint32_t hash) {
+    MigrateBuckets(kMigrateBuckets);
+    Bucket *b = BucketFor(hash);
+    Handle **ptr = FindPointer(b, key, hash);
+    Handle *result = *ptr;
+    if (result != nullptr) {
+      *ptr = result->next_hash;
+      b->SyncKey();
+      --elems_;
+      MaybeShrink();
+    }
+    return result;
+  }
+  Handle *Remove(const Key &key) { return Remove(key, Hasher()(key)); }
+
+  // Grows the table in one step, even in incremental mode, so that it holds
+  // n entries without resizing again. Used before bulk loads. Removals may
+  // still shrink it afterwards.
+  void Reserve(size_t n) {
+    uint32_t length = RoundUpLength(static_cast<uint32_t>(n));
+    if (length <= length_) {
+      return;
+    }
+    MigrateBuckets(old_length_);  // finish a resize in progress
+    COMM_STATS_ADD(stats_.resizes, 1);
+    Resize(length);
+    MigrateBuckets(old_length_);
+  }
+
+  bool resizing() const { return old_list_ != nullptr; }
+  size_t size() const { return elems_; }
+
+  // Appends the entries of the bucket that r picks, as if it was a hash, to
+  // *out. Lets eviction sample the table at random; may append nothing.
+  void SampleBucket(uint32_t r, std::vector<Handle *> *out) const {
+    const Bucket *b = &list_[r & (length_ - 1)];
+    if (old_list_ != nullptr && (r & (old_length_ - 1)) >= migrated_) {
+      b = &old_list_[r & (old_length_ - 1)];
+    }
+    for (Handle *e = b->head; e != nullptr; e = e->next_hash) {
+      out->push_back(e);
+    }
+  }
+
+  // Adds resize and probe-length counters (see cache_stats.h) to *stats.
+  void AddStatsTo(CacheStats *stats) const { stats->Add(stats_); }
+
  private:
+  static const uint32_t kMinLength = 4;
+  // Enough to finish a resize before elems_ crosses either threshold again.
+  static const uint32_t kMigrateBuckets = 8;
+  // Keys in flight at once in MultiLookup().
+  static const size_t kMultiLookupBatch = 16;
+  static const bool kInlineKey = IsFixedWidthKey<Key>::value;
+
+  // A chain head, plus a copy of the head's key when kInlineKey. Every
+  // change of head is followed by SyncKey().
+  template <bool kInline, class Unused = void>
+  struct BucketImpl {
+    Handle *head;
+    Key key;
+
+    bool HeadIs(const Key &k) const { return head != nullptr && Equal()(key, k); }
+    void SyncKey() {
+      if (head != nullptr) {
+        key = head->key();
+      }
+    }
+  };
+  template <class Unused>
+  struct BucketImpl<false, Unused> {
+    Handle *head;
+
+    bool HeadIs(const Key &) const { return false; }
+    void SyncKey() {}
+  };
+  typedef BucketImpl<kInlineKey> Bucket;
+
+  const bool incremental_;
+
   uint32_t length_;
   uint32_t elems_;
 
-  LRUHandle **list_;
+  Bucket *list_;
+
+  // Previous bucket array while a resize is in progress, nullptr otherwise.
+  uint32_t old_length_;
+  uint32_t migrated_;
+  Bucket *old_list_;
+
+  CacheStats stats_;
+
+  // The fields compared by a probe; for LRUHandle the second line holds
+  // the start of the key.
+  static void PrefetchHandle(const Handle *e) {
+    if (e != nullptr) {
+      __builtin_prefetch(e);
+      if (sizeof(Handle) > 64) {
+        __builtin_prefetch(reinterpret_cast<const char *>(e) + 64);
+      }
+    }
+  }
+
+  Bucket *BucketFor(uint32_t hash) {
+    if (old_list_ != nullptr) {
+      uint32_t i = hash & (old_length_ - 1);
+      if (i >= migrated_) {
+        return &old_list_[i];
+      }
+    }
+    return &list_[hash & (length_ - 1)];
+  }
+
+  Handle **FindPointer(const Key &key, uint32_t hash, uint32_t *probes = nullptr) {
+    return FindPointer(BucketFor(hash), key, hash, probes);
+  }
 
-  LRUHandle **FindPointer(const std::string &key, uint32_t hash) {
-    LRUHandle **ptr = &list_[hash & (length_ - 1)];
-    while (*ptr != nullptr && ((*ptr)->hash != hash || key != (*ptr)->key)) {
-      ptr = &(*ptr)->next_hash;
+  Handle **FindPointer(Bucket *b, const Key &key, uint32_t hash, uint32_t *probes = nullptr) {
+    Handle **ptr = &b->head;
+    uint32_t n = 0;
+    if (!b->HeadIs(key)) {
+      while (*ptr != nullptr && ((*ptr)->hash != hash || !Equal()(key, (*ptr)->key()))) {
+        ptr = &(*ptr)->next_hash;
+        n++;
+      }
+    }
+    if (probes != nullptr) {
+      *probes = n;
     }
     return ptr;
   }
 
-  void Resize() {
-    uint32_t new_length = 4;
-    while (new_length < elems_) {
-      new_length *= 2;
+  // Only inserts grow and only removals shrink, so a table presized by
+  // Reserve() keeps its length while it fills up.
+  void MaybeGrow() {
+    if (!resizing() && elems_ > length_) {
+      COMM_STATS_ADD(stats_.resizes, 1);
+      Resize(RoundUpLength(elems_));
     }
-    LRUHandle **new_list = new LRUHandle *[new_length];
-    memset(new_list, 0, sizeof(new_list[0]) * new_length);
-    uint32_t count = 0;
-    for (uint32_t i = 0; i < length_; i++) {
-      LRUHandle *h = list_[i];
-      while (h != nullptr) {
-        LRUHandle *next = h->next_hash;
-        uint32_t hash = h->hash;
-        LRUHandle **ptr = &new_list[hash & (new_length - 1)];
-        h->next_hash = *ptr;
-        *ptr = h;
-        h = next;
-        count++;
+  }
+
+  void MaybeShrink() {
+    if (!resizing() && length_ > kMinLength && elems_ < length_ / 4) {
+      COMM_STATS_ADD(stats_.resizes, 1);
+      Resize(RoundUpLength(elems_ * 2));
+    }
+  }
+
+  static uint32_t RoundUpLength(uint32_t n) {
+    uint32_t length = kMinLength;
+    while (length < n) {
+      length *= 2;
+    }
+    return length;
+  }
+
+  void Resize(uint32_t new_length) {
+    assert(!resizing());
+    Bucket *new_list;
+    {
+      // Only the allocation: MigrateBuckets() times itself.
+      StatsTimer timer(&stats_.resize_nanos);
+      new_list = new Bucket[new_length];
+      for (uint32_t i = 0; i < new_length; i++) {
+        new_list[i].head = nullptr;
       }
     }
-    assert(count == elems_);
-    delete[] list_;
+    old_list_ = list_;
+    old_length_ = length_;
+    migrated_ = 0;
     list_ = new_list;
     length_ = new_length;
+    MigrateBuckets(incremental_ ? kMigrateBuckets : old_length_);
+  }
+
+  // Moves up to n buckets of old_list_ into list_ and releases old_list_
+  // once all of them have been moved.
+  void MigrateBuckets(uint32_t n) {
+    if (old_list_ == nullptr) {
+      return;
+    }
+    StatsTimer timer(&stats_.resize_nanos);
+    uint32_t end = old_length_ - migrated_ > n ? migrated_ + n : old_length_;
+    for (; migrated_ < end; migrated_++) {
+      Handle *h = old_list_[migrated_].head;
+      while (h != nullptr) {
+        Handle *next = h->next_hash;
+        Bucket *b = &list_[h->hash & (length_ - 1)];
+        h->next_hash = b->head;
+        b->head = h;
+        b->SyncKey();
+        h = next;
+      }
+    }
+    if (migrated_ == old_length_) {
+      delete[] old_list_;
+      old_list_ = nullptr;
+      old_length_ = 0;
+    }
   }
 };
+
+// The index of cache shards: LRUHandles keyed by their inline key bytes.
+typedef BasicHandleTable<LRUHandle> HandleTable;
@@ -0,0 +1,1490 @@
+#pragma once
+#include <assert.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+#include "cache_snapshot.h"
+#include "cache_stats.h"
+#include "epoch.h"
+#include "eviction_policy.h"
+#include "handle_slab.h"
+#include "hit_index.h"
+#include "lite_hash.h"
+#include "read_buffer.h"
+#include "secondary_cache.h"
+#include "swiss_table.h"
+#include "timing_wheel.h"
+
+// HandleTable in incremental resize mode, the default index of a shard.
+struct IncrementalHandleTable : public HandleTable {
+  IncrementalHandleTable() : HandleTable(/*incremental_resize=*/true) {}
+};
+
+// new T[n] for types aligned beyond what operator new honours before C++17.
+// Throws std::bad_alloc like new. Pair with DeleteAligned().
+template <class T>
+T *NewAligned(size_t n = 1) {
+  void *p;
+  const size_t align = alignof(T) < sizeof(void *) ? sizeof(void *) : alignof(T);
+  if (posix_memalign(&p, align, sizeof(T) * n) != 0) {
+    throw std::bad_alloc();
+  }
+  T *a = static_cast<T *>(p);
+  for (size_t i = 0; i < n; i++) {
+    new (&a[i]) T();
+  }
+  return a;
+}
+
+template <class T>
+void DeleteAligned(T *a, size_t n = 1) {
+  if (a == nullptr) {
+    return;
+  }
+  for (size_t i = n; i > 0; i--) {
+    a[i - 1].~T();
+  }
+  free(a);
+}
+
+// How a shard runs the deleter of an entry once its last reference is gone.
+enum DeleterMode {
+  kInlineDeleters,      // right away, under the shard lock
+  kBatchedDeleters,     // in batches, by the thread releasing the shard lock
+  kBackgroundDeleters,  // in batches, on a reclaim thread shared by the shards
+};
+
+// The reclaim thread of kBackgroundDeleters. Shards hand it batches of
+// dead handles, which it passes back to Shard::ReclaimBatch() outside of
+// any lock held by the producer. Batches are only accepted while the
+// charge of everything queued stays within max_pending; otherwise TryAdd()
+// fails and the producer reclaims the batch itself, so slow deleters
+// throttle the threads that create garbage instead of letting it pile up.
+template <class Shard>
+class HandleReclaimer {
+ public:
+  explicit HandleReclaimer(size_t max_pending)
+      : max_pending_(max_pending), pending_(0), stop_(false) {
+    thread_ = std::thread(&HandleReclaimer::Run, this);
+  }
+
+  // Reclaims everything still queued before returning.
+  ~HandleReclaimer() {
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  HandleReclaimer(const HandleReclaimer &) = delete;
+  HandleReclaimer &operator=(const HandleReclaimer &) = delete;
+
+  bool TryAdd(Shard *shard, LRUHandle *batch, size_t charge) {
+    std::lock_guard<std::mutex> l(mutex_);
+    if (pending_ + charge > max_pending_) {
+      return false;
+    }
+    queue_.push_back(Batch{shard, batch, charge});
+    pending_ += charge;
+    cv_.notify_one();
+    return true;
+  }
+
+ private:
+  struct Batch {
+    Shard *shard;
+    LRUHandle *handles;
+    size_t charge;
+  };
+
+  void Run() {
+    std::unique_lock<std::mutex> l(mutex_);
+    for (;;) {
+      cv_.wait(l, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      Batch b = queue_.front();
+      queue_.pop_front();
+      l.unlock();
+      b.shard->ReclaimBatch(b.handles);
+      l.lock();
+      pending_ -= b.charge;
+    }
+  }
+
+  const size_t max_pending_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Batch> queue_;
+  size_t pending_;  // charge of the batches in queue_
+  bool stop_;
+  std::thread thread_;
+};
+
+// A single shard of the cache, indexed by a Table with HandleTable's
+// Lookup/Insert/Remove surface (IncrementalHandleTable or SwissHandleTable).
+// Each entry holds one reference for the cache and one per outstanding
+// client handle. Every entry in the table is also linked through
+// next_/prev, on one of two lists:
+//   in_use_:  pinned by clients, in no particular order.
+//   policy_:  only referenced by the cache, in the eviction order of the
+//             shard's EvictionPolicy.
+// Entries move between them in Ref() and Unref(), so eviction never walks
+// past pinned entries. Policies that pin in place (CLOCK, sampled LRU)
+// keep pinned entries on their own order instead and in_use_ stays empty;
+// see EvictionPolicy::pins_in_place(). Erased entries that clients still
+// pin are in none of these structures and die with their last Release().
+//
+// With hit buffering, Lookup() first tries a lock-free HitIndex: a hit
+// there pins the entry with an atomic increment of refs and leaves only a
+// record in the ReadBuffer, and anything else retries under the lock.
+// Every policy pins in place then, since the lock-free path cannot move
+// entries to in_use_. refs only ever drops under the lock, and entries
+// whose last reference is gone wait in limbo_ until no lock-free reader
+// or buffered hit can reach them.
+//
+// Shards are cache-line aligned so neighbouring shards' locks and counters
+// never share a line.
+template <class Table>
+class alignas(64) BasicLRUCache {
+ public:
+  typedef CacheDeleter Deleter;
+
+  // Produces the value for a missing key and stores its charge in *charge,
+  // or returns nullptr if there is none. Must not throw.
+  typedef std::function<void *(const Slice &key, size_t *charge)> Loader;
+  // Receives a pinned handle, or nullptr if the load failed.
+  typedef std::function<void(LRUHandle *)> LoadCallback;
+
+  BasicLRUCache()
+      : capacity_(0),
+        secondary_(nullptr),
+        codec_(nullptr),
+        usage_(0),
+        deleter_mode_(kInlineDeleters),
+        max_pending_charge_(0),
+        reclaimer_(nullptr),
+        policy_(NewEvictionPolicy(kLRUEviction)),
+        read_buffer_(nullptr),
+        hit_index_(nullptr),
+        epoch_(nullptr),
+        limbo_(nullptr),
+        limbo_count_(0),
+        unlocked_hits_(0),
+        wheel_(ExpiryClockMillis()),
+        deferred_(nullptr),
+        deferred_count_(0),
+        deferred_charge_(0) {}
+
+  ~BasicLRUCache() {
+    Prune();
+    assert(table_.size() == 0);  // Error if caller has an unreleased handle
+    assert(deferred_ == nullptr && limbo_ == nullptr);
+    DeleteAligned(read_buffer_);
+    delete hit_index_;
+    delete policy_;
+  }
+
+  void SetCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> l(mutex_);
+    capacity_ = capacity;
+    policy_->SetCapacity(capacity);
+  }
+
+  // Must be called before the first Insert().
+  void SetEvictionPolicy(EvictionPolicyType type) {
+    std::lock_guard<std::mutex> l(mutex_);
+    assert(table_.size() == 0);
+    delete policy_;
+    policy_ = NewEvictionPolicy(type);
+    if (read_buffer_ != nullptr) {
+      policy_->SetPinsInPlace();
+    }
+    policy_->SetCapacity(capacity_);
+    policy_->SetSampler(&SampleTable, &table_);
+  }
+
+  // Spills capacity evictions to secondary and promotes its hits on a miss.
+  // Neither is owned. Must be called before the first Insert().
+  void SetSecondaryCache(SecondaryCache *secondary, const CacheValueCodec *codec) {
+    assert(secondary == nullptr || codec != nullptr);
+    secondary_ = secondary;
+    codec_ = codec;
+  }
+
+  // Deleters of dead entries are deferred unless mode is kInlineDeleters.
+  // They run once kDeferredBatch entries, or more than max_pending_charge
+  // of charge, have accumulated, and on Prune(). reclaimer is only used by
+  // kBackgroundDeleters; it can be reset to nullptr to fall back to
+  // kBatchedDeleters. Must be called before the first Insert().
+  void SetDeleterMode(DeleterMode mode, size_t max_pending_charge,
+                      HandleReclaimer<BasicLRUCache> *reclaimer) {
+    std::lock_guard<std::mutex> l(mutex_);
+    deleter_mode_ = mode;
+    max_pending_charge_ = max_pending_charge;
+    reclaimer_ = reclaimer;
+  }
+
+  // With buffering, hits are served without the shard lock where
+  // possible, recorded in a ReadBuffer and applied to the eviction policy by
+  // the next thread that takes the lock, instead of by the reader under it.
+  // epoch guards the lock-free readers; it may be shared with other shards
+  // and must outlive this one. nullptr turns buffering off. Must be called
+  // before the first Insert().
+  void SetHitBuffering(EpochManager *epoch) {
+    std::lock_guard<std::mutex> l(mutex_);
+    assert(table_.size() == 0);
+    DeleteAligned(read_buffer_);
+    delete hit_index_;
+    read_buffer_ = nullptr;
+    hit_index_ = nullptr;
+    epoch_ = epoch;
+    if (epoch != nullptr) {
+      read_buffer_ = NewAligned<ReadBuffer>();
+      hit_index_ = new HitIndex(epoch);
+      policy_->SetPinsInPlace();
+    }
+  }
+
+  // With ttl_ms > 0 the entry expires that many milliseconds from now.
+  // Returns nullptr, without taking ownership of value, if the handle
+  // cannot be allocated.
+  LRUHandle *Insert(const Slice &key, uint32_t hash, void *value, size_t charge,
+                    Deleter deleter, uint64_t ttl_ms = 0) {
+    std::vector<LRUHandle *> spilled;
+    LRUHandle *e;
+    {
+      ShardLock l(this);
+      e = InsertLocked(key, hash, value, charge, deleter, ttl_ms, &spilled);
+      if (e == nullptr) {
+        return nullptr;
+      }
+    }
+    FinishInsert(key, hash, spilled);
+    return e;
+  }
+
+  LRUHandle *Lookup(const Slice &key, uint32_t hash) {
+    LRUHandle *e = hit_index_ != nullptr ? LookupUnlocked(key, hash) : nullptr;
+    if (e != nullptr) {
+      return e;
+    }
+    {
+      ShardLock l(this);
+      e = CheckExpiry(table_.Lookup(key, hash));
+      COMM_STATS_ADD(stats_.lookups, 1);
+      if (e != nullptr) {
+        COMM_STATS_ADD(stats_.hits, 1);
+        Ref(e);
+        TouchLocked(e);
+      }
+    }
+    if (e != nullptr) {
+      TouchUnlocked(e);
+      return e;
+    }
+    return secondary_ != nullptr ? Promote(key, hash) : nullptr;
+  }
+
+  // Looks up n keys under a single acquisition of the shard lock; out[i] is
+  // pinned like the result of Lookup().
+  void MultiLookup(size_t n, const Slice *keys, const uint32_t *hashes, LRUHandle **out) {
+    {
+      ShardLock l(this);
+      table_.MultiLookup(n, keys, hashes, out);
+      COMM_STATS_ADD(stats_.lookups, n);
+      for (size_t i = 0; i < n; i++) {
+        LRUHandle *e = out[i];
+        if (e != nullptr && IsExpired(e)) {
+          // A repeated key found the same entry, which Expire() may free.
+          for (size_t j = i + 1; j < n; j++) {
+            if (out[j] == e) {
+              out[j] = nullptr;
+            }
+          }
+          Expire(e);
+          e = out[i] = nullptr;
+        }
+        if (e != nullptr) {
+          COMM_STATS_ADD(stats_.hits, 1);
+          Ref(e);
+          TouchLocked(e);
+        }
+      }
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (out[i] != nullptr) {
+        TouchUnlocked(out[i]);
+      } else if (secondary_ != nullptr) {
+        out[i] = Promote(keys[i], hashes[i]);
+      }
+    }
+  }
+
+  // Calls done with the entry for key, loading it on a miss. Concurrent
+  // misses on the same key share one load: the first caller runs loader in
+  // its own thread, and the callbacks of the others are queued and run by
+  // that thread once the value is in the cache. A hit, or the caller that
+  // ran the load, gets done called before this returns. A loaded value is
+  // inserted with ttl_ms as in Insert().
+  void LookupOrLoad(const Slice &key, uint32_t hash, const Loader &loader, Deleter deleter,
+                    const LoadCallback &done, uint64_t ttl_ms = 0) {
+    LRUHandle *e;
+    {
+      ShardLock l(this);
+      e = CheckExpiry(table_.Lookup(key, hash));
+      COMM_STATS_ADD(stats_.lookups, 1);
+      if (e != nullptr) {
+        COMM_STATS_ADD(stats_.hits, 1);
+        Ref(e);
+        TouchLocked(e);
+      } else {
+        auto r = loads_.emplace(key.ToString(), std::vector<LoadCallback>());
+        if (!r.second) {
+          r.first->second.push_back(done);  // a load is already running
+          return;
+        }
+      }
+    }
+    if (e != nullptr) {
+      TouchUnlocked(e);
+    } else {
+      e = secondary_ != nullptr ? Promote(key, hash) : nullptr;
+      if (e == nullptr) {
+        size_t charge = 0;
+        void *value = loader(key, &charge);
+        if (value != nullptr &&
+            (e = Insert(key, hash, value, charge, deleter, ttl_ms)) == nullptr) {
+          (*deleter)(key, value);
+        }
+      }
+      std::vector<LoadCallback> waiters;
+      {
+        std::lock_guard<std::mutex> l(mutex_);
+        auto it = loads_.find(key.ToString());
+        waiters.swap(it->second);
+        loads_.erase(it);
+        for (size_t i = 0; e != nullptr && i < waiters.size(); i++) {
+          Ref(e);
+        }
+      }
+      for (size_t i = 0; i < waiters.size(); i++) {
+        waiters[i](e);
+      }
+    }
+    done(e);
+  }
+
+  void Release(LRUHandle *handle) {
+    ShardLock l(this);
+    Unref(handle);
+  }
+
+  void Erase(const Slice &key, uint32_t hash) {
+    {
+      ShardLock l(this);
+      FinishErase(table_.Remove(key, hash));
+      CancelSpills(key, hash);
+      CancelPromotes(key, hash);
+    }
+    if (secondary_ != nullptr) {
+      EraseSecondary(key, hash);
+    }
+  }
+
+  // Drops every entry that is not pinned by a client, and runs all
+  // deferred deleters.
+  void Prune() {
+    ShardLock l(this, /*flush=*/true);
+    LRUHandle *e;
+    while ((e = policy_->Victim()) != nullptr) {
+      FinishErase(table_.Remove(e->key(), e->hash));
+    }
+  }
+
+  size_t TotalCharge() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    return usage_;
+  }
+
+  // Presizes the table for n more entries, ahead of a bulk load.
+  void Reserve(size_t n) {
+    std::lock_guard<std::mutex> l(mutex_);
+    table_.Reserve(table_.size() + n);
+  }
+
+  // Appends every entry to *out, coldest first, each pinned like the
+  // result of Lookup(). Entries pinned already count as the hottest unless
+  // the policy pins in place.
+  void PinEntries(std::vector<LRUHandle *> *out) {
+    std::lock_guard<std::mutex> l(mutex_);
+    const size_t start = out->size();
+    policy_->Entries(out);
+    in_use_.AppendTo(out);
+    for (size_t i = start; i < out->size(); i++) {
+      Ref((*out)[i]);
+    }
+  }
+
+  // Drops up to max entries whose TTL has run out, or all of them if max
+  // is 0. Returns how many were dropped; fewer than max means none are left.
+  size_t ReapExpired(size_t max) {
+    std::vector<LRUHandle *> expired;
+    ShardLock l(this);
+    wheel_.Advance(ExpiryClockMillis(), max == 0 ? SIZE_MAX : max, &expired);
+    for (size_t i = 0; i < expired.size(); i++) {
+      LRUHandle *e = expired[i];
+      FinishErase(table_.Remove(e->key(), e->hash));
+      COMM_STATS_ADD(stats_.expirations, 1);
+    }
+    return expired.size();
+  }
+
+  CacheStats GetStats() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    CacheStats stats = stats_;
+    const uint64_t unlocked = unlocked_hits_.load(std::memory_order_relaxed);
+    stats.lookups += unlocked;
+    stats.hits += unlocked;
+    table_.AddStatsTo(&stats);
+    return stats;
+  }
+
+  // Runs the deleters of a list of dead handles linked through next_ and
+  // returns their memory to the slab. Called without mutex_.
+  void ReclaimBatch(LRUHandle *batch) {
+    for (LRUHandle *e = batch; e != nullptr; e = e->next_) {
+      (*e->deleter)(e->key(), e->value);
+    }
+    std::lock_guard<std::mutex> l(mutex_);
+    while (batch != nullptr) {
+      LRUHandle *next = batch->next_;
+      slab_.Free(batch, LRUHandle::SizeOf(batch->key_length, batch->has_timer));
+      batch = next;
+    }
+  }
+
+ private:
+  // Dead entries deferred before their deleters run, in a batch.
+  static const size_t kDeferredBatch = 32;
+
+  // Holds mutex_ like a std::unique_lock. On destruction it takes a batch
+  // of deferred entries, if one is due or flush is set, and reclaims it
+  // after releasing mutex_.
+  class ShardLock {
+   public:
+    explicit ShardLock(BasicLRUCache *shard, bool flush = false)
+        : shard_(shard), lock_(shard->mutex_), flush_(flush) {
+      shard_->DrainReadBuffer();
+    }
+
+    ~ShardLock() {
+      if (flush_) {
+        shard_->DrainReadBuffer(/*flush=*/true);  // for what died meanwhile
+      }
+      size_t charge = 0;
+      LRUHandle *batch = shard_->TakeDeferred(flush_, &charge);
+      lock_.unlock();
+      if (batch != nullptr) {
+        shard_->ReclaimDeferred(batch, charge);
+      }
+    }
+
+    ShardLock(const ShardLock &) = delete;
+    ShardLock &operator=(const ShardLock &) = delete;
+
+    void lock() {
+      lock_.lock();
+      shard_->DrainReadBuffer();
+    }
+    void unlock() { lock_.unlock(); }
+
+   private:
+    BasicLRUCache *const shard_;
+    std::unique_lock<std::mutex> lock_;
+    const bool flush_;
+  };
+
+  // Lookup() without mutex_, through hit_index_. Returns nullptr whenever
+  // the hit cannot be taken that way, for the caller to retry under the
+  // lock: on a miss, an expired entry, or one whose last reference is gone.
+  // The critical section ends before the caller falls back to mutex_,
+  // whose holder may be waiting for a grace period.
+  LRUHandle *LookupUnlocked(const Slice &key, uint32_t hash) {
+    EpochGuard guard(epoch_);
+    LRUHandle *e = hit_index_->Lookup(key, hash);
+    if (e == nullptr || IsExpired(e) || !TryRef(e)) {
+      return nullptr;
+    }
+#if COMM_CACHE_STATS
+    unlocked_hits_.fetch_add(1, std::memory_order_relaxed);
+#endif
+    read_buffer_->Record(e);
+    return e;
+  }
+
+  // Pins e unless its refs already dropped to 0, without mutex_.
+  static bool TryRef(LRUHandle *e) {
+    uint32_t refs = __atomic_load_n(&e->refs, __ATOMIC_RELAXED);
+    do {
+      if (refs == 0) {
+        return false;
+      }
+    } while (!__atomic_compare_exchange_n(&e->refs, &refs, refs + 1, /*weak=*/true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+  }
+
+  // refs is updated atomically, as TryRef() may race with the lock holder.
+  void Ref(LRUHandle *e) {
+    // If on the policy's lists, move to in_use_.
+    if (!policy_->pins_in_place() && e->refs == 1 && e->in_cache) {
+      policy_->Pin(e);
+      in_use_.Append(e);
+    }
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+  }
+
+  // A hit on e, pinned by the caller, reaches the policy through one of
+  // these: directly under mutex_, or through read_buffer_ once mutex_ has
+  // been released.
+  void TouchLocked(LRUHandle *e) {
+    if (read_buffer_ == nullptr) {
+      policy_->Touch(e);
+    }
+  }
+  void TouchUnlocked(LRUHandle *e) {
+    if (read_buffer_ != nullptr) {
+      read_buffer_->Record(e);
+    }
+  }
+
+  // Applies buffered hits to the policy, and frees the entries in limbo_
+  // once a batch of them is due, or with flush, if the drain was complete.
+  // mutex_ must be held. Runs on every acquisition through ShardLock.
+  void DrainReadBuffer(bool flush = false) {
+    if (read_buffer_ == nullptr) {
+      return;
+    }
+    EvictionPolicy *policy = policy_;
+    const bool complete = read_buffer_->Drain([policy](LRUHandle *e) {
+      if (e->in_cache) {
+        policy->Touch(e);
+      }
+    });
+    if (complete && limbo_ != nullptr && (flush || limbo_count_ >= kDeferredBatch)) {
+      // Every hit recorded before these entries died has been applied, and
+      // after the grace period no lock-free reader still looks at them.
+      epoch_->Synchronize();
+      LRUHandle *e = limbo_;
+      limbo_ = nullptr;
+      limbo_count_ = 0;
+      while (e != nullptr) {
+        LRUHandle *next = e->next_;
+        Dispose(e);
+        e = next;
+      }
+    }
+  }
+
+  static void SampleTable(const void *table, uint32_t r, std::vector<LRUHandle *> *out) {
+    static_cast<const Table *>(table)->SampleBucket(r, out);
+  }
+
+  void Unref(LRUHandle *e) {
+    assert(__atomic_load_n(&e->refs, __ATOMIC_RELAXED) > 0);
+    const uint32_t refs = __atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL);
+    // No longer in use; back to the policy.
+    if (refs == 1 && e->in_cache && !policy_->pins_in_place()) {
+      in_use_.Remove(e);
+      policy_->Unpin(e);
+    } else if (refs == 0) {  // Deallocate.
+      assert(!e->in_cache);
+      if (read_buffer_ != nullptr) {
+        // Lock-free readers and buffered hits may still reach e.
+        e->next_ = limbo_;
+        limbo_ = e;
+        limbo_count_++;
+      } else {
+        Dispose(e);
+      }
+    }
+  }
+
+  // Runs the deleter of a dead entry, or defers it. mutex_ must be held.
+  void Dispose(LRUHandle *e) {
+    if (deleter_mode_ == kInlineDeleters) {
+      (*e->deleter)(e->key(), e->value);
+      slab_.Free(e, LRUHandle::SizeOf(e->key_length, e->has_timer));
+    } else {
+      e->next_ = deferred_;
+      deferred_ = e;
+      deferred_count_++;
+      deferred_charge_ += e->charge;
+    }
+  }
+
+  // Detaches the deferred list if a batch is due. mutex_ must be held.
+  LRUHandle *TakeDeferred(bool flush, size_t *charge) {
+    if (deferred_ == nullptr || (!flush && deferred_count_ < kDeferredBatch &&
+                                 deferred_charge_ <= max_pending_charge_)) {
+      return nullptr;
+    }
+    LRUHandle *batch = deferred_;
+    *charge = deferred_charge_;
+    deferred_ = nullptr;
+    deferred_count_ = 0;
+    deferred_charge_ = 0;
+    return batch;
+  }
+
+  void ReclaimDeferred(LRUHandle *batch, size_t charge) {
+    if (deleter_mode_ == kBackgroundDeleters && reclaimer_ != nullptr &&
+        reclaimer_->TryAdd(this, batch, charge)) {
+      return;
+    }
+    ReclaimBatch(batch);
+  }
+
+  // Insert() under mutex_. Evictions bound for the secondary tier are
+  // appended to *spilled, for FinishInsert() once mutex_ is released.
+  LRUHandle *InsertLocked(const Slice &key, uint32_t hash, void *value, size_t charge,
+                          Deleter deleter, uint64_t ttl_ms, std::vector<LRUHandle *> *spilled) {
+    const bool has_timer = ttl_ms > 0;
+    LRUHandle *e = reinterpret_cast<LRUHandle *>(
+        slab_.Allocate(LRUHandle::SizeOf(key.size(), has_timer)));
+    if (e == nullptr) {
+      return nullptr;
+    }
+    CancelSpills(key, hash);
+    CancelPromotes(key, hash);
+    e->value = value;
+    e->deleter = deleter;
+    e->charge = charge;
+    e->key_length = key.size();
+    e->hash = hash;
+    e->in_cache = false;
+    e->policy_bits = 0;
+    e->access_time = 0;
+    e->has_timer = has_timer;
+    e->refs = 0;
+    memcpy(e->key_data, key.data(), key.size());
+    if (has_timer) {
+      LRUHandleTimer *t = e->timer();
+      t->expire_at = ExpiryClockMillis() + ttl_ms;
+      t->next = nullptr;
+      t->pprev = nullptr;
+    }
+    if (capacity_ > 0) {
+      e->refs = 1;  // for the cache's reference.
+      e->in_cache = true;
+      usage_ += charge;
+      COMM_STATS_ADD(stats_.inserts, 1);
+      if (FinishErase(table_.Insert(e))) {
+        COMM_STATS_ADD(stats_.replacements, 1);
+      }
+      policy_->Insert(e);
+      if (has_timer) {
+        wheel_.Schedule(e);
+      }
+      if (hit_index_ != nullptr) {
+        hit_index_->Add(e);
+      }
+    } else {
+      // capacity_ == 0 turns caching off; the returned handle still works.
+      e->next_ = nullptr;
+    }
+    Ref(e);  // for the returned handle.
+    LRUHandle *victim;
+    while (usage_ > capacity_ && (victim = policy_->Victim()) != nullptr) {
+      COMM_STATS_ADD(stats_.evictions, 1);
+      if (secondary_ == nullptr) {
+        FinishErase(table_.Remove(victim->key(), victim->hash));
+        continue;
+      }
+      // Keep the cache's reference so the value survives until it has been
+      // written to the secondary tier outside the lock.
+      LRUHandle *removed = table_.Remove(victim->key(), victim->hash);
+      assert(removed == victim);
+      (void)removed;
+      policy_->Erase(victim);
+      wheel_.Cancel(victim);
+      if (hit_index_ != nullptr) {
+        hit_index_->Remove(victim);
+      }
+      victim->in_cache = false;
+      usage_ -= victim->charge;
+      spilled->push_back(victim);
+      spilling_.push_back(victim);
+    }
+    return e;
+  }
+
+  // The part of Insert() that runs without mutex_.
+  void FinishInsert(const Slice &key, uint32_t hash, const std::vector<LRUHandle *> &spilled) {
+    if (secondary_ != nullptr) {
+      EraseSecondary(key, hash);  // the new value supersedes a spilled one
+      if (!spilled.empty()) {
+        Spill(spilled);
+        ShardLock l(this);
+        for (size_t i = 0; i < spilled.size(); i++) {
+          Unref(spilled[i]);
+        }
+      }
+    }
+  }
+
+  // Writes evicted entries to the secondary tier. Called without mutex_;
+  // the entries are no longer in the cache but still referenced. Entries
+  // whose spill an Insert() or Erase() of the same key cancelled meanwhile
+  // are skipped, so a stale value never overwrites a newer change. A
+  // spilled value is prefixed with the entry's expire_at, native uint64,
+  // which Promote() turns back into a TTL; expired entries are dropped.
+  void Spill(const std::vector<LRUHandle *> &entries) {
+    std::vector<std::string> bufs(entries.size());
+    std::vector<char> serialized(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+      LRUHandle *e = entries[i];
+      if (!IsExpired(e)) {
+        const uint64_t expire_at = e->expire_at();
+        bufs[i].append(reinterpret_cast<const char *>(&expire_at), sizeof(expire_at));
+        serialized[i] = codec_->Serialize(e->value, &bufs[i]);
+      }
+    }
+    // Claiming the spills and writing them under spill_mutex_ orders them
+    // with the EraseSecondary() of any later Insert() or Erase().
+    std::lock_guard<std::mutex> s(spill_mutex_);
+    std::vector<char> claimed(entries.size());
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      for (size_t i = 0; i < entries.size(); i++) {
+        for (size_t j = 0; j < spilling_.size(); j++) {
+          if (spilling_[j] == entries[i]) {
+            spilling_[j] = spilling_.back();
+            spilling_.pop_back();
+            claimed[i] = true;
+            break;
+          }
+        }
+      }
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+      LRUHandle *e = entries[i];
+      if (!claimed[i]) {
+        continue;
+      } else if (serialized[i]) {
+        secondary_->Insert(e->key(), e->hash, bufs[i]);
+      } else {
+        secondary_->Erase(e->key(), e->hash);
+      }
+    }
+  }
+
+  // Drops the pending spills of key. mutex_ must be held.
+  void CancelSpills(const Slice &key, uint32_t hash) {
+    for (size_t i = 0; i < spilling_.size();) {
+      if (spilling_[i]->hash == hash && spilling_[i]->key() == key) {
+        spilling_[i] = spilling_.back();
+        spilling_.pop_back();
+      } else {
+        i++;
+      }
+    }
+  }
+
+  // Makes the running Promote()s of key discard what they read: the secondary
+  // tier may no longer hold the latest value. mutex_ must be held.
+  void CancelPromotes(const Slice &key, uint32_t hash) {
+    for (size_t i = 0; i < promoting_.size(); i++) {
+      if (promoting_[i]->hash == hash && promoting_[i]->key == key) {
+        promoting_[i]->cancelled = true;
+      }
+    }
+  }
+
+  // Whether an eviction of key is still on its way to the secondary tier.
+  // mutex_ must be held.
+  bool SpillPending(const Slice &key, uint32_t hash) const {
+    for (size_t i = 0; i < spilling_.size(); i++) {
+      if (spilling_[i]->hash == hash && spilling_[i]->key() == key) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void EraseSecondary(const Slice &key, uint32_t hash) {
+    std::lock_guard<std::mutex> s(spill_mutex_);
+    secondary_->Erase(key, hash);
+  }
+
+  // A Promote() that has read the secondary tier but not yet inserted what
+  // it found. Lives on Promote()'s stack.
+  struct PendingPromote {
+    Slice key;
+    uint32_t hash;
+    bool cancelled;  // key was written since; what was read may be stale
+  };
+
+  // Moves a secondary hit back into memory. Returns nullptr on a miss.
+  //
+  // The value read from secondary_ is only inserted if nothing touched key
+  // in between: an Insert() or Erase() of key cancels the promote, which
+  // then drops its value and returns whatever the cache holds now, so a
+  // stale read never overwrites a newer write. A key whose eviction is
+  // still being spilled counts as a miss, as secondary_ lags behind it.
+  LRUHandle *Promote(const Slice &key, uint32_t hash) {
+    PendingPromote pending = {key, hash, false};
+    {
+      ShardLock l(this);
+      LRUHandle *e = CheckExpiry(table_.Lookup(key, hash));
+      if (e != nullptr) {  // inserted since the caller missed
+        Ref(e);
+        return e;
+      }
+      if (SpillPending(key, hash)) {
+        return nullptr;
+      }
+      promoting_.push_back(&pending);
+    }
+
+    std::string buf;
+    const bool found = secondary_->Lookup(key, hash, &buf);
+    uint64_t expire_at;
+    uint64_t ttl_ms = 0;
+    size_t charge = 0;
+    void *value = nullptr;
+    if (found && buf.size() >= sizeof(expire_at)) {
+      memcpy(&expire_at, buf.data(), sizeof(expire_at));
+      const uint64_t now = ExpiryClockMillis();
+      if (expire_at == 0 || expire_at > now) {
+        ttl_ms = expire_at == 0 ? 0 : expire_at - now;
+        value = codec_->Deserialize(
+            Slice(buf.data() + sizeof(expire_at), buf.size() - sizeof(expire_at)), &charge);
+      }
+    }
+
+    std::vector<LRUHandle *> spilled;
+    LRUHandle *e = nullptr;
+    bool cancelled;
+    {
+      ShardLock l(this);
+      promoting_.erase(std::find(promoting_.begin(), promoting_.end(), &pending));
+      cancelled = pending.cancelled;
+      if (cancelled) {
+        e = CheckExpiry(table_.Lookup(key, hash));
+        if (e != nullptr) {
+          Ref(e);
+        }
+      } else if (value != nullptr) {
+        e = InsertLocked(key, hash, value, charge, codec_->deleter(), ttl_ms, &spilled);
+      }
+    }
+    if (value != nullptr && (cancelled || e == nullptr)) {
+      (*codec_->deleter())(key, value);
+    } else if (value != nullptr) {
+      FinishInsert(key, hash, spilled);
+    } else if (found && !cancelled) {
+      EraseSecondary(key, hash);  // expired or unreadable
+    }
+    return e;
+  }
+
+  static bool IsExpired(const LRUHandle *e) {
+    return e->has_timer && e->timer()->expire_at <= ExpiryClockMillis();
+  }
+
+  // Lazy expiry: returns e, or nullptr after dropping e if its TTL ran out.
+  LRUHandle *CheckExpiry(LRUHandle *e) {
+    if (e != nullptr && IsExpired(e)) {
+      Expire(e);
+      return nullptr;
+    }
+    return e;
+  }
+
+  void Expire(LRUHandle *e) {
+    FinishErase(table_.Remove(e->key(), e->hash));
+    COMM_STATS_ADD(stats_.expirations, 1);
+  }
+
+  // Finishes removing *e, which has just been unlinked from table_.
+  // Returns whether e != nullptr.
+  bool FinishErase(LRUHandle *e) {
+    if (e != nullptr) {
+      assert(e->in_cache);
+      if (IsPinned(e) && !policy_->pins_in_place()) {
+        in_use_.Remove(e);
+      }
+      policy_->Erase(e);
+      wheel_.Cancel(e);
+      if (hit_index_ != nullptr) {
+        hit_index_->Remove(e);
+      }
+      e->in_cache = false;
+      usage_ -= e->charge;
+      Unref(e);
+    }
+    return e != nullptr;
+  }
+
+  size_t capacity_;
+  SecondaryCache *secondary_;
+  const CacheValueCodec *codec_;
+
+  // Serializes writes to secondary_. Never acquired while holding mutex_.
+  std::mutex spill_mutex_;
+
+  // mutex_ protects the following state.
+  mutable std::mutex mutex_;
+  size_t usage_;
+  DeleterMode deleter_mode_;
+  size_t max_pending_charge_;
+  HandleReclaimer<BasicLRUCache> *reclaimer_;
+  EvictionPolicy *policy_;
+  LRUList in_use_;
+  std::vector<LRUHandle *> spilling_;  // evicted, not yet claimed by Spill()
+  std::vector<PendingPromote *> promoting_;  // Promote()s between read and insert
+  ReadBuffer *read_buffer_;  // nullptr unless hits are buffered
+  HitIndex *hit_index_;      // set along with read_buffer_
+  EpochManager *epoch_;      // guards hit_index_ readers; not owned
+  // Dead entries, linked through next_, that hit_index_ readers or
+  // read_buffer_ may still reach. See DrainReadBuffer().
+  LRUHandle *limbo_;
+  size_t limbo_count_;
+  std::atomic<uint64_t> unlocked_hits_;  // lookups and hits made without mutex_
+  CacheStats stats_;
+  HandleSlab slab_;
+  TimingWheel wheel_;
+
+  Table table_;
+
+  // Keys being loaded by LookupOrLoad() and the callbacks waiting on them.
+  std::unordered_map<std::string, std::vector<LoadCallback>> loads_;
+
+  // Dead entries whose deleters have not run yet, linked through next_.
+  LRUHandle *deferred_;
+  size_t deferred_count_;
+  size_t deferred_charge_;
+};
+
+typedef BasicLRUCache<IncrementalHandleTable> LRUCache;
+
+struct LRUCacheOptions {
+  static const int kDefaultNumShardBits = 6;
+
+  LRUCacheOptions()
+      : capacity(0),
+        num_shard_bits(kDefaultNumShardBits),
+        eviction_policy(kLRUEviction),
+        secondary_cache(nullptr),
+        value_codec(nullptr),
+        deleter_mode(kInlineDeleters),
+        max_pending_deleter_charge(0),
+        buffer_hits(false) {}
+
+  // Total charge the cache may hold, split evenly over the shards.
+  size_t capacity;
+
+  // The cache has 1 << num_shard_bits shards.
+  int num_shard_bits;
+
+  // How each shard picks what to evict.
+  EvictionPolicyType eviction_policy;
+
+  // If set, entries evicted for capacity are serialized with value_codec
+  // into secondary_cache, and misses are looked up there and promoted back.
+  // Both must outlive the cache.
+  SecondaryCache *secondary_cache;
+  const CacheValueCodec *value_codec;
+
+  // Where deleters run. The deferred modes take expensive destructors out
+  // from under the shard locks.
+  DeleterMode deleter_mode;
+
+  // Bound on the charge of dead entries whose deleters have not run yet,
+  // across the whole cache; 0 means capacity / 16. Beyond it, deleters run
+  // right away, outside the shard lock, in the thread that dropped them.
+  size_t max_pending_deleter_charge;
+
+  // Serve hits without the shard lock where possible, record them in
+  // per-shard read buffers, and apply them to the eviction policy in
+  // batches, so lookups do no list work. Recency is approximate: a hit is
+  // dropped when its buffer is full. Misses, MultiLookup() and
+  // LookupOrLoad() still take the lock.
+  bool buffer_hits;
+};
+
+// Spreads entries over 1 << num_shard_bits independently locked shards,
+// picked by the top bits of the hash so that the low bits stay free for
+// bucket selection in the shard's Table.
+template <class Table>
+class BasicShardedLRUCache {
+ public:
+  // Opaque handle to an entry; valid until passed to Release().
+  struct Handle {};
+
+  static const size_t kDefaultReapBatch = 64;
+
+  typedef typename BasicLRUCache<Table>::Deleter Deleter;
+  typedef typename BasicLRUCache<Table>::Loader Loader;
+  typedef std::function<void(Handle *)> LoadCallback;
+
+  explicit BasicShardedLRUCache(const LRUCacheOptions &options)
+      : num_shard_bits_(options.num_shard_bits),
+        reclaimer_(nullptr),
+        epoch_(nullptr),
+        last_id_(0) {
+    assert(num_shard_bits_ >= 0 && num_shard_bits_ < 32);
+    const size_t num_shards = NumShards();
+    const size_t per_shard = (options.capacity + (num_shards - 1)) / num_shards;
+    size_t max_pending = options.max_pending_deleter_charge;
+    if (max_pending == 0) {
+      max_pending = options.capacity / 16;
+    }
+    if (options.deleter_mode == kBackgroundDeleters) {
+      reclaimer_ = new HandleReclaimer<BasicLRUCache<Table>>(max_pending);
+    }
+    if (options.buffer_hits) {
+      epoch_ = NewAligned<EpochManager>();
+    }
+    shard_ = NewAligned<BasicLRUCache<Table>>(num_shards);
+    for (size_t s = 0; s < num_shards; s++) {
+      shard_[s].SetCapacity(per_shard);
+      shard_[s].SetEvictionPolicy(options.eviction_policy);
+      shard_[s].SetSecondaryCache(options.secondary_cache, options.value_codec);
+      shard_[s].SetDeleterMode(options.deleter_mode, max_pending / num_shards, reclaimer_);
+      shard_[s].SetHitBuffering(epoch_);
+    }
+  }
+
+  explicit BasicShardedLRUCache(size_t capacity,
+                                int num_shard_bits = LRUCacheOptions::kDefaultNumShardBits)
+      : BasicShardedLRUCache(MakeOptions(capacity, num_shard_bits)) {}
+  ~BasicShardedLRUCache() {
+    if (reclaimer_ != nullptr) {
+      // Hand the remaining garbage to the reclaimer and wait for it, before
+      // the shards it refers to go away.
+      const size_t num_shards = NumShards();
+      for (size_t s = 0; s < num_shards; s++) {
+        shard_[s].Prune();
+      }
+      delete reclaimer_;
+      for (size_t s = 0; s < num_shards; s++) {
+        shard_[s].SetDeleterMode(kBatchedDeleters, 0, nullptr);
+      }
+    }
+    DeleteAligned(shard_, NumShards());
+    DeleteAligned(epoch_);
+  }
+
+  BasicShardedLRUCache(const BasicShardedLRUCache &) = delete;
+  BasicShardedLRUCache &operator=(const BasicShardedLRUCache &) = delete;
+
+  // Inserts key->value with the given charge against capacity and returns a
+  // handle pinning the entry. The caller must Release() it when done.
+  // The overloads without a hash use Hash32(key); callers that pass their
+  // own hash must use the same function for every operation on a key.
+  // With ttl_ms > 0 the entry expires that many milliseconds from now:
+  // lookups stop finding it, and ReapExpired() reclaims it. Returns nullptr,
+  // leaving value to the caller, if memory for the entry runs out.
+  Handle *Insert(const Slice &key, uint32_t hash, void *value, size_t charge,
+                 Deleter deleter, uint64_t ttl_ms = 0) {
+    return reinterpret_cast<Handle *>(
+        shard_[Shard(hash)].Insert(key, hash, value, charge, deleter, ttl_ms));
+  }
+  Handle *Insert(const Slice &key, void *value, size_t charge, Deleter deleter,
+                 uint64_t ttl_ms = 0) {
+    return Insert(key, Hash32(key), value, charge, deleter, ttl_ms);
+  }
+
+  // Returns nullptr on a miss, otherwise a pinned handle to be Release()d.
+  Handle *Lookup(const Slice &key, uint32_t hash) {
+    return reinterpret_cast<Handle *>(shard_[Shard(hash)].Lookup(key, hash));
+  }
+  Handle *Lookup(const Slice &key) { return Lookup(key, Hash32(key)); }
+
+  // Lookup() that loads missing keys with loader, once per key no matter
+  // how many threads miss on it at the same time. The callback form never
+  // blocks on another thread's load: done runs in the thread that finishes
+  // the load, so it should be short. Either way the handle is pinned, or
+  // nullptr if loader returned nullptr. A loaded value expires after ttl_ms
+  // as in Insert().
+  void LookupOrLoad(const Slice &key, uint32_t hash, const Loader &loader, Deleter deleter,
+                    const LoadCallback &done, uint64_t ttl_ms = 0) {
+    shard_[Shard(hash)].LookupOrLoad(
+        key, hash, loader, deleter,
+        [done](LRUHandle *e) { done(reinterpret_cast<Handle *>(e)); }, ttl_ms);
+  }
+  void LookupOrLoad(const Slice &key, const Loader &loader, Deleter deleter,
+                    const LoadCallback &done, uint64_t ttl_ms = 0) {
+    LookupOrLoad(key, Hash32(key), loader, deleter, done, ttl_ms);
+  }
+
+  // Blocks until the entry is loaded, by this thread or another one.
+  Handle *LookupOrLoad(const Slice &key, uint32_t hash, const Loader &loader, Deleter deleter,
+                       uint64_t ttl_ms = 0) {
+    std::mutex mu;
+    std::condition_variable cv;
+    bool ready = false;
+    Handle *result = nullptr;
+    LookupOrLoad(
+        key, hash, loader, deleter,
+        [&](Handle *h) {
+          std::lock_guard<std::mutex> l(mu);
+          result = h;
+          ready = true;
+          cv.notify_one();
+        },
+        ttl_ms);
+    std::unique_lock<std::mutex> l(mu);
+    cv.wait(l, [&ready] { return ready; });
+    return result;
+  }
+  Handle *LookupOrLoad(const Slice &key, const Loader &loader, Deleter deleter,
+                       uint64_t ttl_ms = 0) {
+    return LookupOrLoad(key, Hash32(key), loader, deleter, ttl_ms);
+  }
+
+#if defined(__cpp_impl_coroutine)
+  // co_await cache.AsyncLookupOrLoad(key, loader, deleter) yields the pinned
+  // handle. A coroutine waiting on another caller's load is suspended and
+  // resumed in the thread that completes it.
+  class LoadAwaitable {
+   public:
+    LoadAwaitable(BasicShardedLRUCache *cache, const Slice &key, uint32_t hash, Loader loader,
+                  Deleter deleter, uint64_t ttl_ms)
+        : cache_(cache),
+          key_(key.ToString()),
+          hash_(hash),
+          loader_(std::move(loader)),
+          deleter_(deleter),
+          ttl_ms_(ttl_ms),
+          result_(nullptr),
+          state_(kStarted) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    // Returns false, resuming at once, if the result came in synchronously.
+    bool await_suspend(std::coroutine_handle<> coro) {
+      cache_->LookupOrLoad(
+          key_, hash_, loader_, deleter_,
+          [this, coro](Handle *h) {
+            result_ = h;
+            if (state_.exchange(kDone, std::memory_order_acq_rel) == kSuspended) {
+              coro.resume();
+            }
+          },
+          ttl_ms_);
+      return state_.exchange(kSuspended, std::memory_order_acq_rel) != kDone;
+    }
+
+    Handle *await_resume() const noexcept { return result_; }
+
+   private:
+    enum { kStarted, kSuspended, kDone };
+
+    BasicShardedLRUCache *const cache_;
+    const std::string key_;
+    const uint32_t hash_;
+    const Loader loader_;
+    const Deleter deleter_;
+    const uint64_t ttl_ms_;
+    Handle *result_;
+    std::atomic<int> state_;
+  };
+
+  LoadAwaitable AsyncLookupOrLoad(const Slice &key, uint32_t hash, Loader loader,
+                                  Deleter deleter, uint64_t ttl_ms = 0) {
+    return LoadAwaitable(this, key, hash, std::move(loader), deleter, ttl_ms);
+  }
+  LoadAwaitable AsyncLookupOrLoad(const Slice &key, Loader loader, Deleter deleter,
+                                  uint64_t ttl_ms = 0) {
+    return AsyncLookupOrLoad(key, Hash32(key), std::move(loader), deleter, ttl_ms);
+  }
+#endif
+
+  // out[i] = Lookup(keys[i], hashes[i]) for i < n. Keys are grouped by
+  // shard so each shard is locked once and its table can prefetch the
+  // whole group (see HandleTable::MultiLookup).
+  void MultiLookup(size_t n, const Slice *keys, const uint32_t *hashes, Handle **out) {
+    std::vector<uint32_t> order(n);
+    std::vector<size_t> begin(NumShards() + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+      begin[Shard(hashes[i]) + 1]++;
+    }
+    for (size_t s = 0; s < NumShards(); s++) {
+      begin[s + 1] += begin[s];
+    }
+    std::vector<size_t> next(begin.begin(), begin.end() - 1);
+    for (size_t i = 0; i < n; i++) {
+      order[next[Shard(hashes[i])]++] = static_cast<uint32_t>(i);
+    }
+    std::vector<Slice> group_keys(n);
+    std::vector<uint32_t> group_hashes(n);
+    std::vector<LRUHandle *> group_out(n);
+    for (size_t i = 0; i < n; i++) {
+      group_keys[i] = keys[order[i]];
+      group_hashes[i] = hashes[order[i]];
+    }
+    for (size_t s = 0; s < NumShards(); s++) {
+      if (begin[s + 1] > begin[s]) {
+        shard_[s].MultiLookup(begin[s + 1] - begin[s], &group_keys[begin[s]],
+                              &group_hashes[begin[s]], &group_out[begin[s]]);
+      }
+    }
+    for (size_t i = 0; i < n; i++) {
+      out[order[i]] = reinterpret_cast<Handle *>(group_out[i]);
+    }
+  }
+  void MultiLookup(size_t n, const Slice *keys, Handle **out) {
+    std::vector<uint32_t> hashes(n);
+    for (size_t i = 0; i < n; i++) {
+      hashes[i] = Hash32(keys[i]);
+    }
+    MultiLookup(n, keys, hashes.data(), out);
+  }
+
+  void Release(Handle *handle) {
+    LRUHandle *h = reinterpret_cast<LRUHandle *>(handle);
+    shard_[Shard(h->hash)].Release(h);
+  }
+
+  void *Value(Handle *handle) { return reinterpret_cast<LRUHandle *>(handle)->value; }
+
+  // The entry is dropped from the cache now and destroyed once the last
+  // outstanding handle is released.
+  void Erase(const Slice &key, uint32_t hash) { shard_[Shard(hash)].Erase(key, hash); }
+  void Erase(const Slice &key) { Erase(key, Hash32(key)); }
+
+  uint64_t NewId() {
+    std::lock_guard<std::mutex> l(id_mutex_);
+    return ++(last_id_);
+  }
+
+  void Prune() {
+    for (size_t s = 0; s < NumShards(); s++) {
+      shard_[s].Prune();
+    }
+  }
+
+  // Drops every expired entry, locking each shard for at most batch
+  // entries at a time, or once per shard if batch is 0. Returns the number
+  // dropped.
+  size_t ReapExpired(size_t batch = kDefaultReapBatch) {
+    size_t total = 0;
+    for (size_t s = 0; s < NumShards(); s++) {
+      size_t n;
+      do {
+        n = shard_[s].ReapExpired(batch);
+        total += n;
+      } while (batch != 0 && n == batch);
+    }
+    return total;
+  }
+
+  size_t TotalCharge() const {
+    size_t total = 0;
+    for (size_t s = 0; s < NumShards(); s++) {
+      total += shard_[s].TotalCharge();
+    }
+    return total;
+  }
+
+  // Counters summed over all shards; all zero unless built with
+  // COMM_CACHE_STATS.
+  CacheStats GetStats() const {
+    CacheStats total;
+    for (size_t s = 0; s < NumShards(); s++) {
+      total.Add(shard_[s].GetStats());
+    }
+    return total;
+  }
+
+  // Writes the entries that codec can serialize to a snapshot file at path,
+  // shard by shard and coldest first within a shard. Only the shard being
+  // collected is locked, and only while its entries are pinned. Entries
+  // whose TTL has run out are left out; the others keep their deadline.
+  // Returns false and leaves errno set on an I/O error; a previous snapshot
+  // at path then stays intact.
+  bool SaveSnapshot(const std::string &path, const CacheValueCodec &codec) {
+    CacheSnapshotWriter *writer = CacheSnapshotWriter::Create(path);
+    if (writer == nullptr) {
+      return false;
+    }
+    const uint64_t now = ExpiryClockMillis();
+    const uint64_t wall_now = SnapshotClockMillis();
+    std::vector<LRUHandle *> entries;
+    std::string buf;
+    for (size_t s = 0; s < NumShards(); s++) {
+      entries.clear();
+      shard_[s].PinEntries(&entries);
+      for (size_t i = 0; i < entries.size(); i++) {
+        LRUHandle *e = entries[i];
+        buf.clear();
+        const uint64_t expire_at = e->expire_at();
+        if ((expire_at == 0 || expire_at > now) && codec.Serialize(e->value, &buf)) {
+          writer->Add(e->key(), buf, expire_at == 0 ? 0 : wall_now + (expire_at - now));
+        }
+        shard_[s].Release(e);
+      }
+    }
+    bool ok = writer->Finish();
+    int saved = errno;
+    delete writer;
+    errno = saved;
+    return ok;
+  }
+
+  // Inserts the entries of a SaveSnapshot() file. Each shard's table is
+  // presized once for its share of the file, and entries are inserted in
+  // file order so the hottest ones end up most recently used. Records the
+  // codec rejects, or whose TTL ran out, are skipped; the others get the
+  // rest of their TTL. Returns false and leaves errno set if the file
+  // cannot be read or is not an intact snapshot; nothing is inserted then.
+  // Stores the number of inserted entries in *loaded if not nullptr.
+  // Snapshots hold no hashes: keys are rehashed with hasher, which must be
+  // the function the caller passes to the overloads that take a hash.
+  bool LoadSnapshot(const std::string &path, const CacheValueCodec &codec,
+                    size_t *loaded = nullptr, uint32_t (*hasher)(const Slice &) = &Hash32) {
+    CacheSnapshotReader *reader = CacheSnapshotReader::Open(path);
+    if (reader == nullptr) {
+      return false;
+    }
+    std::vector<size_t> per_shard(NumShards(), 0);
+    std::vector<uint32_t> hashes;
+    hashes.reserve(reader->count());
+    const uint64_t now = SnapshotClockMillis();
+    Slice key, value;
+    uint64_t expire_at;
+    while (reader->Next(&key, &value, &expire_at)) {
+      hashes.push_back(hasher(key));
+      if (expire_at == 0 || expire_at > now) {
+        per_shard[Shard(hashes.back())]++;
+      }
+    }
+    for (size_t s = 0; s < NumShards(); s++) {
+      if (per_shard[s] > 0) {
+        shard_[s].Reserve(per_shard[s]);
+      }
+    }
+    reader->Rewind();
+    size_t n = 0;
+    for (size_t i = 0; reader->Next(&key, &value, &expire_at); i++) {
+      if (expire_at != 0 && expire_at <= now) {
+        continue;
+      }
+      size_t charge = 0;
+      void *v = codec.Deserialize(value, &charge);
+      if (v == nullptr) {
+        continue;
+      }
+      Handle *h = Insert(key, hashes[i], v, charge, codec.deleter(),
+                         expire_at == 0 ? 0 : expire_at - now);
+      if (h == nullptr) {
+        (*codec.deleter())(key, v);
+        continue;
+      }
+      Release(h);
+      n++;
+    }
+    delete reader;
+    if (loaded != nullptr) {
+      *loaded = n;
+    }
+    return true;
+  }
+
+  CacheStats GetShardStats(size_t shard) const {
+    assert(shard < NumShards());
+    return shard_[shard].GetStats();
+  }
+
+  size_t NumShards() const { return size_t{1} << num_shard_bits_; }
+
+ private:
+  static LRUCacheOptions MakeOptions(size_t capacity, int num_shard_bits) {
+    LRUCacheOptions options;
+    options.capacity = capacity;
+    options.num_shard_bits = num_shard_bits;
+    return options;
+  }
+
+  uint32_t Shard(uint32_t hash) const {
+    return num_shard_bits_ == 0 ? 0 : hash >> (32 - num_shard_bits_);
+  }
+
+  const int num_shard_bits_;
+  BasicLRUCache<Table> *shard_;
+  HandleReclaimer<BasicLRUCache<Table>> *reclaimer_;  // kBackgroundDeleters only
+  EpochManager *epoch_;  // shared by the shards' lock-free hits; buffer_hits only
+  std::mutex id_mutex_;
+  uint64_t last_id_;
+};
+
+typedef BasicShardedLRUCache<IncrementalHandleTable> ShardedLRUCache;
+typedef BasicShardedLRUCache<SwissHandleTable> SwissShardedLRUCache;
+
+// Calls cache->ReapExpired(batch) on a background thread every interval
+// until destroyed, so memory held by expired entries that are never looked
+// up again is reclaimed.
+template <class Cache>
+class CacheReaper {
+ public:
+  CacheReaper(Cache *cache, std::chrono::milliseconds interval,
+              size_t batch = Cache::kDefaultReapBatch)
+      : cache_(cache), interval_(interval), batch_(batch), stop_(false) {
+    thread_ = std::thread(&CacheReaper::Run, this);
+  }
+
+  ~CacheReaper() {
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  CacheReaper(const CacheReaper &) = delete;
+  CacheReaper &operator=(const CacheReaper &) = delete;
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (!cv_.wait_for(l, interval_, [this] { return stop_; })) {
+      l.unlock();
+      cache_->ReapExpired(batch_);
+      l.lock();
+    }
+  }
+
+  Cache *const cache_;
+  const std::chrono::milliseconds interval_;
+  const size_t batch_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_;
+  std::thread thread_;
+};
@@ -0,0 +1,94 @@
+#pragma once
+#include <assert.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+#include "lite_hash.h"
+
+// Hits of a cache shard waiting to be applied to its eviction policy, in the
+// style of Caffeine's read buffers. A reader records the handle it pinned
+// without holding the shard lock, and whichever thread takes the lock
+// next replays the buffered hits with Drain(), so hits never do list work
+// themselves.
+//
+// Hits are spread over kStripes rings by thread. A ring is a bounded
+// multi-producer queue with a single consumer, the shard lock holder. It is
+// lossy: a record is dropped when its ring is full or another thread is
+// recording into it at the same moment, which only costs a little recency
+// information.
+//
+// Drain() never waits for a writer that has reserved a slot but not filled
+// it yet: it stops that stripe there, and a later Drain() picks up the rest.
+// Handles must be pinned while they are recorded, and a handle whose last
+// pin is dropped may still have a record waiting behind such a slot. The
+// shard therefore keeps dead handles until a Drain() returns true, which
+// means it reached every record reserved before it started.
+class ReadBuffer {
+ public:
+  static const size_t kStripes = 8;
+  static const uint32_t kSlots = 16;
+
+  ReadBuffer() {
+    for (size_t i = 0; i < kStripes; i++) {
+      stripe_[i].head.store(0, std::memory_order_relaxed);
+      stripe_[i].tail.store(0, std::memory_order_relaxed);
+      for (uint32_t j = 0; j < kSlots; j++) {
+        stripe_[i].slot[j].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  ReadBuffer(const ReadBuffer &) = delete;
+  ReadBuffer &operator=(const ReadBuffer &) = delete;
+
+  // Returns false if the hit was dropped. May be called from any thread.
+  bool Record(LRUHandle *e) {
+    static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+    Stripe &s = stripe_[hint % kStripes];
+    uint32_t tail = s.tail.load(std::memory_order_relaxed);
+    if (tail - s.head.load(std::memory_order_acquire) >= kSlots ||
+        !s.tail.compare_exchange_strong(tail, tail + 1, std::memory_order_relaxed)) {
+      return false;
+    }
+    s.slot[tail % kSlots].store(e, std::memory_order_release);
+    return true;
+  }
+
+  // Calls apply on every recorded handle, oldest first within a stripe, up
+  // to the first slot that is reserved but not yet written. Returns whether
+  // there was no such slot. Must be serialized by the caller.
+  template <class Fn>
+  bool Drain(Fn apply) {
+    bool complete = true;
+    for (size_t i = 0; i < kStripes; i++) {
+      Stripe &s = stripe_[i];
+      uint32_t head = s.head.load(std::memory_order_relaxed);
+      const uint32_t tail = s.tail.load(std::memory_order_acquire);
+      for (; head != tail; head++) {
+        std::atomic<LRUHandle *> &slot = s.slot[head % kSlots];
+        LRUHandle *e = slot.load(std::memory_order_acquire);
+        if (e == nullptr) {
+          complete = false;
+          break;
+        }
+        slot.store(nullptr, std::memory_order_relaxed);
+        apply(e);
+      }
+      s.head.store(head, std::memory_order_release);
+    }
+    return complete;
+  }
+
+ private:
+  struct alignas(64) Stripe {
+    std::atomic<uint32_t> head;  // next slot to drain
+    std::atomic<uint32_t> tail;  // next slot to reserve
+    std::atomic<LRUHandle *> slot[kSlots];
+  };
+
+  Stripe stripe_[kStripes];
+};
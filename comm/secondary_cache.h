@@ -0,0 +1,303 @@
+#pragma once
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#include "lite_hash.h"
+#include "slice.h"
+
+// Turns cache values into bytes and back, for tiers and snapshots that
+// outlive the in-memory value.
+class CacheValueCodec {
+ public:
+  virtual ~CacheValueCodec() {}
+
+  // Appends the serialized form of value to *out. Returns false if this
+  // value should not leave memory.
+  virtual bool Serialize(const void *value, std::string *out) const = 0;
+
+  // Rebuilds a value from Serialize() output, or returns nullptr if data is
+  // unusable. Stores the charge of the new value in *charge.
+  virtual void *Deserialize(const Slice &data, size_t *charge) const = 0;
+
+  // Deleter for values returned by Deserialize().
+  virtual CacheDeleter deleter() const = 0;
+};
+
+// A second cache tier below the in-memory shards. Entries evicted for
+// capacity are offered to Insert(), and a primary miss consults Lookup()
+// and promotes hits back into memory. Implementations must be thread-safe.
+// Values spilled by the shards carry a deadline on ExpiryClockMillis(),
+// which only means something within the process that wrote them.
+class SecondaryCache {
+ public:
+  virtual ~SecondaryCache() {}
+
+  virtual void Insert(const Slice &key, uint32_t hash, const Slice &value) = 0;
+
+  // On a hit, stores a copy of the value in *value.
+  virtual bool Lookup(const Slice &key, uint32_t hash, std::string *value) = 0;
+
+  virtual void Erase(const Slice &key, uint32_t hash) = 0;
+};
+
+// SecondaryCache over a fixed-size file mapped into memory and written as a
+// circular log. Each record is
+//   key_length: uint32  value_length: uint32  hash: uint32  key  value
+// padded to 8 bytes. Appending past the oldest record drops it, so the tier
+// evicts in FIFO order and a write never needs more than a memcpy. A record
+// that would straddle the end of the file is preceded by a wrap marker and
+// written at offset 0 instead.
+//
+// The index lives in memory: an open-addressing array of 8-byte slots
+// holding the key's hash and the record offset / 8. Keys are compared
+// against the record itself. The index is not persisted; the file only
+// extends memory across the process lifetime.
+class MmapSecondaryCache : public SecondaryCache {
+ public:
+  // Creates (or truncates) path to capacity bytes and maps it. Returns
+  // nullptr and leaves errno set if the file cannot be created or mapped.
+  static MmapSecondaryCache *Open(const std::string &path, size_t capacity) {
+    capacity &= ~size_t{7};
+    if (capacity < 2 * kHeaderSize || capacity / 8 >= kTombstone) {
+      errno = EINVAL;
+      return nullptr;
+    }
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return nullptr;
+    }
+    if (::ftruncate(fd, static_cast<off_t>(capacity)) != 0) {
+      ::close(fd);
+      return nullptr;
+    }
+    void *base = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      ::close(fd);
+      return nullptr;
+    }
+    return new MmapSecondaryCache(fd, static_cast<char *>(base), capacity);
+  }
+
+  ~MmapSecondaryCache() override {
+    ::munmap(base_, capacity_);
+    ::close(fd_);
+    delete[] index_;
+  }
+
+  MmapSecondaryCache(const MmapSecondaryCache &) = delete;
+  MmapSecondaryCache &operator=(const MmapSecondaryCache &) = delete;
+
+  void Insert(const Slice &key, uint32_t hash, const Slice &value) override {
+    const size_t size = RecordSize(key.size(), value.size());
+    if (size + kHeaderSize > capacity_) {
+      return;  // would not fit even in an empty log
+    }
+    std::lock_guard<std::mutex> l(mutex_);
+    if (head_ + size > capacity_) {
+      // Drop everything up to the end of the file, mark the wrap, restart at 0.
+      MakeRoom(capacity_ - head_);
+      if (head_ + kHeaderSize <= capacity_) {
+        WriteHeader(head_, kWrapMarker, 0, 0);
+      }
+      head_ = 0;
+      wrapped_ = true;
+    }
+    MakeRoom(size);
+    const size_t offset = head_;
+    WriteHeader(offset, static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size()),
+                hash);
+    memcpy(base_ + offset + kHeaderSize, key.data(), key.size());
+    memcpy(base_ + offset + kHeaderSize + key.size(), value.data(), value.size());
+    head_ += size;
+    if (head_ == capacity_) {
+      head_ = 0;
+      wrapped_ = true;
+    }
+    IndexInsert(key, hash, offset);
+  }
+
+  bool Lookup(const Slice &key, uint32_t hash, std::string *value) override {
+    std::lock_guard<std::mutex> l(mutex_);
+    size_t slot;
+    if (!IndexFind(key, hash, &slot)) {
+      return false;
+    }
+    const size_t offset = SlotOffset(index_[slot]);
+    uint32_t key_length, value_length, record_hash;
+    ReadHeader(offset, &key_length, &value_length, &record_hash);
+    value->assign(base_ + offset + kHeaderSize + key_length, value_length);
+    return true;
+  }
+
+  void Erase(const Slice &key, uint32_t hash) override {
+    std::lock_guard<std::mutex> l(mutex_);
+    size_t slot;
+    if (IndexFind(key, hash, &slot)) {
+      index_[slot].pos = kTombstone;
+      live_--;
+    }
+  }
+
+  size_t capacity() const { return capacity_; }
+
+ private:
+  static const size_t kHeaderSize = 12;
+  static const uint32_t kWrapMarker = 0xffffffffu;
+  static const uint32_t kEmpty = 0;
+  static const uint32_t kTombstone = 0xffffffffu;
+
+  struct IndexSlot {
+    uint32_t hash;
+    uint32_t pos;  // record offset / 8 + 1, or kEmpty / kTombstone
+  };
+
+  MmapSecondaryCache(int fd, char *base, size_t capacity)
+      : fd_(fd),
+        base_(base),
+        capacity_(capacity),
+        head_(0),
+        tail_(0),
+        wrapped_(false),
+        index_mask_(0),
+        live_(0),
+        used_(0),
+        index_(nullptr) {
+    ResizeIndex(64);
+  }
+
+  static size_t RecordSize(size_t key_length, size_t value_length) {
+    return (kHeaderSize + key_length + value_length + 7) & ~size_t{7};
+  }
+
+  static size_t SlotOffset(const IndexSlot &s) { return (static_cast<size_t>(s.pos) - 1) * 8; }
+
+  void WriteHeader(size_t offset, uint32_t key_length, uint32_t value_length, uint32_t hash) {
+    uint32_t h[3] = {key_length, value_length, hash};
+    memcpy(base_ + offset, h, sizeof(h));
+  }
+
+  void ReadHeader(size_t offset, uint32_t *key_length, uint32_t *value_length,
+                  uint32_t *hash) const {
+    uint32_t h[3];
+    memcpy(h, base_ + offset, sizeof(h));
+    *key_length = h[0];
+    *value_length = h[1];
+    *hash = h[2];
+  }
+
+  // Drops the oldest records until [head_, head_ + size) holds none.
+  void MakeRoom(size_t size) {
+    while (wrapped_ && tail_ < head_ + size) {
+      if (tail_ + kHeaderSize > capacity_) {
+        tail_ = 0;
+        wrapped_ = false;
+        break;
+      }
+      uint32_t key_length, value_length, hash;
+      ReadHeader(tail_, &key_length, &value_length, &hash);
+      if (key_length == kWrapMarker) {
+        tail_ = 0;
+        wrapped_ = false;
+        break;
+      }
+      IndexDropRecord(Slice(base_ + tail_ + kHeaderSize, key_length), hash, tail_);
+      tail_ += RecordSize(key_length, value_length);
+      if (tail_ >= capacity_) {
+        tail_ = 0;
+        wrapped_ = false;
+      }
+    }
+  }
+
+  bool IndexFind(const Slice &key, uint32_t hash, size_t *slot) const {
+    for (size_t i = hash & index_mask_;; i = (i + 1) & index_mask_) {
+      const IndexSlot &s = index_[i];
+      if (s.pos == kEmpty) {
+        return false;
+      }
+      if (s.pos != kTombstone && s.hash == hash) {
+        const size_t offset = SlotOffset(s);
+        uint32_t key_length, value_length, record_hash;
+        ReadHeader(offset, &key_length, &value_length, &record_hash);
+        if (Slice(base_ + offset + kHeaderSize, key_length) == key) {
+          *slot = i;
+          return true;
+        }
+      }
+    }
+  }
+
+  void IndexInsert(const Slice &key, uint32_t hash, size_t offset) {
+    size_t slot;
+    if (IndexFind(key, hash, &slot)) {
+      index_[slot].pos = static_cast<uint32_t>(offset / 8 + 1);
+      return;
+    }
+    if ((used_ + 1) * 2 > index_mask_ + 1) {
+      ResizeIndex(live_ * 4 > index_mask_ + 1 ? (index_mask_ + 1) * 2 : index_mask_ + 1);
+    }
+    size_t i = hash & index_mask_;
+    while (index_[i].pos != kEmpty && index_[i].pos != kTombstone) {
+      i = (i + 1) & index_mask_;
+    }
+    if (index_[i].pos == kEmpty) {
+      used_++;
+    }
+    index_[i].hash = hash;
+    index_[i].pos = static_cast<uint32_t>(offset / 8 + 1);
+    live_++;
+  }
+
+  // The record at offset is being overwritten; unindex it unless the key
+  // was rewritten later in the log.
+  void IndexDropRecord(const Slice &key, uint32_t hash, size_t offset) {
+    size_t slot;
+    if (IndexFind(key, hash, &slot) && SlotOffset(index_[slot]) == offset) {
+      index_[slot].pos = kTombstone;
+      live_--;
+    }
+  }
+
+  // Rebuilds the index with new_length slots, dropping tombstones.
+  void ResizeIndex(size_t new_length) {
+    IndexSlot *old = index_;
+    const size_t old_length = old == nullptr ? 0 : index_mask_ + 1;
+    index_ = new IndexSlot[new_length];
+    memset(index_, 0, sizeof(IndexSlot) * new_length);
+    index_mask_ = new_length - 1;
+    used_ = live_;
+    for (size_t i = 0; i < old_length; i++) {
+      if (old[i].pos != kEmpty && old[i].pos != kTombstone) {
+        size_t j = old[i].hash & index_mask_;
+        while (index_[j].pos != kEmpty) {
+          j = (j + 1) & index_mask_;
+        }
+        index_[j] = old[i];
+      }
+    }
+    delete[] old;
+  }
+
+  const int fd_;
+  char *const base_;
+  const size_t capacity_;
+
+  // mutex_ protects the following state.
+  std::mutex mutex_;
+  size_t head_;   // where the next record goes
+  size_t tail_;   // oldest record still in the log, if wrapped_
+  bool wrapped_;  // head_ has wrapped around behind tail_
+  size_t index_mask_;
+  size_t live_;  // indexed records
+  size_t used_;  // non-empty slots, live or tombstone
+  IndexSlot *index_;
+};
@@ -0,0 +1,313 @@
+#pragma once
+#include <assert.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "cache_stats.h"
+#include "hash.h"
+#include "lite_hash.h"
+#include "slice.h"
+
+// Open-addressing index over LRUHandle pointers with the same surface as
+// HandleTable (Lookup/Insert/Remove), in the style of a Swiss table.
+//
+// Slots are split into groups of SwissGroup::kWidth. Next to the slot array
+// lives one control byte per slot: kEmpty, kDeleted, or the low 7 bits of a
+// secondary hash (H2) when full. A probe loads a whole group of control
+// bytes, compares all of them against H2 at once (SSE2/AVX2, or 8 bytes at a
+// time in a uint64_t elsewhere) and only dereferences the handles whose H2
+// matched, so a lookup usually touches one control group and one handle
+// instead of walking a next_hash chain. Groups are probed quadratically and
+// a probe stops at the first group that still has an empty slot.
+//
+// LRUHandle::next_hash is not used by this table.
+
+static const int8_t kSwissEmpty = -128;  // 0b10000000
+static const int8_t kSwissDeleted = -2;  // 0b11111110
+
+#if defined(__AVX2__)
+struct SwissGroup {
+  static const size_t kWidth = 32;
+  static const int kShift = 0;
+
+  explicit SwissGroup(const int8_t *p)
+      : ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p))) {}
+
+  uint64_t Match(int8_t h2) const {
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl)));
+  }
+  uint64_t MatchEmpty() const { return Match(kSwissEmpty); }
+  // Empty and deleted are the only control bytes with the sign bit set.
+  uint64_t MatchEmptyOrDeleted() const {
+    return static_cast<uint32_t>(_mm256_movemask_epi8(ctrl));
+  }
+
+  __m256i ctrl;
+};
+#elif defined(__SSE2__)
+struct SwissGroup {
+  static const size_t kWidth = 16;
+  static const int kShift = 0;
+
+  explicit SwissGroup(const int8_t *p)
+      : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))) {}
+
+  uint64_t Match(int8_t h2) const {
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl)));
+  }
+  uint64_t MatchEmpty() const { return Match(kSwissEmpty); }
+  // Empty and deleted are the only control bytes with the sign bit set.
+  uint64_t MatchEmptyOrDeleted() const { return static_cast<uint32_t>(_mm_movemask_epi8(ctrl)); }
+
+  __m128i ctrl;
+};
+#else
+// Portable fallback: one group is a little-endian uint64_t and a match is
+// reported in the high bit of the matching byte.
+struct SwissGroup {
+  static const size_t kWidth = 8;
+  static const int kShift = 3;
+  static const uint64_t kLsbs = 0x0101010101010101ull;
+  static const uint64_t kMsbs = 0x8080808080808080ull;
+
+  explicit SwissGroup(const int8_t *p) { memcpy(&ctrl, p, sizeof(ctrl)); }
+
+  // May report a false positive on a byte following a real match; callers
+  // compare the key anyway.
+  uint64_t Match(int8_t h2) const {
+    uint64_t x = ctrl ^ (kLsbs * static_cast<uint8_t>(h2));
+    return (x - kLsbs) & ~x & kMsbs;
+  }
+  uint64_t MatchEmpty() const { return (ctrl & (~ctrl << 6)) & kMsbs; }
+  uint64_t MatchEmptyOrDeleted() const { return ctrl & kMsbs; }
+
+  uint64_t ctrl;
+};
+#endif
+
+class SwissHandleTable {
+ public:
+  SwissHandleTable() : groups_(0), size_(0), growth_left_(0), ctrl_(nullptr), slots_(nullptr) {
+    Rehash(1);
+  }
+  ~SwissHandleTable() {
+    delete[] ctrl_;
+    delete[] slots_;
+  }
+
+  SwissHandleTable(const SwissHandleTable &) = delete;
+  SwissHandleTable &operator=(const SwissHandleTable &) = delete;
+
+  LRUHandle *Lookup(const Slice &key, uint32_t hash) {
+    size_t slot;
+    uint32_t probes = 0;
+    LRUHandle *result = Find(key, hash, &slot, &probes) ? slots_[slot] : nullptr;
+    COMM_STATS_ADD(stats_.probe_histogram[ProbeHistogramBucket(probes)], 1);
+    return result;
+  }
+  LRUHandle *Lookup(const Slice &key) { return Lookup(key, Hash32(key)); }
+
+  // Same as out[i] = Lookup(keys[i], hashes[i]) for i < n. Prefetches the
+  // first control group of every key in a batch, then the slot each key's
+  // first H2 match points at, then that handle, and only then probes, so
+  // the misses of different keys overlap.
+  void MultiLookup(size_t n, const Slice *keys, const uint32_t *hashes, LRUHandle **out) {
+    static const size_t kBatch = 16;
+    for (size_t start = 0; start < n; start += kBatch) {
+      const size_t m = n - start < kBatch ? n - start : kBatch;
+      const uint32_t *h = hashes + start;
+      size_t first[kBatch];
+      for (size_t i = 0; i < m; i++) {
+        const size_t base = H1(h[i]) * SwissGroup::kWidth;
+        __builtin_prefetch(ctrl_ + base);
+        __builtin_prefetch(slots_ + base);
+      }
+      for (size_t i = 0; i < m; i++) {
+        const size_t base = H1(h[i]) * SwissGroup::kWidth;
+        uint64_t match = SwissGroup(ctrl_ + base).Match(H2(h[i]));
+        first[i] = match != 0 ? base + (CountTrailingZeros(match) >> SwissGroup::kShift)
+                              : Capacity();
+      }
+      for (size_t i = 0; i < m; i++) {
+        if (first[i] < Capacity() && slots_[first[i]] != nullptr) {
+          __builtin_prefetch(&slots_[first[i]]->hash);
+          __builtin_prefetch(slots_[first[i]]->key_data);
+        }
+      }
+      for (size_t i = 0; i < m; i++) {
+        out[start + i] = Lookup(keys[start + i], h[i]);
+      }
+    }
+  }
+
+  // Returns the entry h replaced, or nullptr if its key was not present.
+  LRUHandle *Insert(LRUHandle *h) {
+    size_t slot;
+    if (Find(h->key(), h->hash, &slot)) {
+      LRUHandle *old = slots_[slot];
+      slots_[slot] = h;
+      return old;
+    }
+    if (growth_left_ == 0) {
+      // Reclaim tombstones in place if they are what filled the table.
+      COMM_STATS_ADD(stats_.resizes, 1);
+      Rehash(size_ * 16 < Capacity() * 7 ? groups_ : groups_ * 2);
+    }
+    slot = FindInsertSlot(h->hash);
+    if (ctrl_[slot] == kSwissEmpty) {
+      growth_left_--;
+    }
+    ctrl_[slot] = H2(h->hash);
+    slots_[slot] = h;
+    size_++;
+    return nullptr;
+  }
+
+  LRUHandle *Remove(const Slice &key, uint32_t hash) {
+    size_t slot;
+    if (!Find(key, hash, &slot)) {
+      return nullptr;
+    }
+    LRUHandle *result = slots_[slot];
+    // A probe never stops in a group that had no empty slot when it passed,
+    // so the slot may only become empty again if its group still has one.
+    size_t base = slot & ~(SwissGroup::kWidth - 1);
+    if (SwissGroup(ctrl_ + base).MatchEmpty() != 0) {
+      ctrl_[slot] = kSwissEmpty;
+      growth_left_++;
+    } else {
+      ctrl_[slot] = kSwissDeleted;
+    }
+    slots_[slot] = nullptr;
+    size_--;
+    if (groups_ > 1 && size_ * 4 < Capacity()) {
+      COMM_STATS_ADD(stats_.resizes, 1);
+      Rehash(groups_ / 2);
+    }
+    return result;
+  }
+  LRUHandle *Remove(const Slice &key) { return Remove(key, Hash32(key)); }
+
+  // Rehashes once so that n entries fit without growing again. Removals may
+  // still shrink the table afterwards.
+  void Reserve(size_t n) {
+    size_t groups = groups_;
+    while (groups * SwissGroup::kWidth * 7 / 8 < n) {
+      groups *= 2;
+    }
+    if (groups > groups_) {
+      COMM_STATS_ADD(stats_.resizes, 1);
+      Rehash(groups);
+    }
+  }
+
+  size_t size() const { return size_; }
+
+  // Appends the entries of the group that r picks to *out, like
+  // HandleTable::SampleBucket().
+  void SampleBucket(uint32_t r, std::vector<LRUHandle *> *out) const {
+    const size_t base = H1(r) * SwissGroup::kWidth;
+    for (size_t s = base; s < base + SwissGroup::kWidth; s++) {
+      if (ctrl_[s] >= 0) {
+        out->push_back(slots_[s]);
+      }
+    }
+  }
+
+  // Adds resize and probe-length counters (see cache_stats.h) to *stats.
+  void AddStatsTo(CacheStats *stats) const { stats->Add(stats_); }
+
+ private:
+  size_t Capacity() const { return groups_ * SwissGroup::kWidth; }
+
+  // H1 picks the first group from the low bits, like HandleTable's bucket
+  // mask. H2 comes from the top bits of a multiplicative remix, so it stays
+  // informative inside a cache shard whose entries share their top hash bits.
+  size_t H1(uint32_t hash) const { return hash & (groups_ - 1); }
+  static int8_t H2(uint32_t hash) { return static_cast<int8_t>((hash * 0x9e3779b9u) >> 25); }
+
+  static size_t CountTrailingZeros(uint64_t m) { return __builtin_ctzll(m); }
+
+  bool Find(const Slice &key, uint32_t hash, size_t *slot, uint32_t *probes = nullptr) const {
+    const int8_t h2 = H2(hash);
+    size_t g = H1(hash);
+    for (size_t i = 1;; i++) {
+      if (probes != nullptr) {
+        *probes = static_cast<uint32_t>(i - 1);
+      }
+      const size_t base = g * SwissGroup::kWidth;
+      SwissGroup group(ctrl_ + base);
+      for (uint64_t m = group.Match(h2); m != 0; m &= m - 1) {
+        size_t s = base + (CountTrailingZeros(m) >> SwissGroup::kShift);
+        LRUHandle *e = slots_[s];
+        if (e != nullptr && e->hash == hash && e->key() == key) {
+          *slot = s;
+          return true;
+        }
+      }
+      if (group.MatchEmpty() != 0 || i > groups_) {
+        return false;
+      }
+      g = (g + i) & (groups_ - 1);
+    }
+  }
+
+  size_t FindInsertSlot(uint32_t hash) const {
+    size_t g = H1(hash);
+    for (size_t i = 1;; i++) {
+      const size_t base = g * SwissGroup::kWidth;
+      uint64_t m = SwissGroup(ctrl_ + base).MatchEmptyOrDeleted();
+      if (m != 0) {
+        return base + (CountTrailingZeros(m) >> SwissGroup::kShift);
+      }
+      assert(i <= groups_);
+      g = (g + i) & (groups_ - 1);
+    }
+  }
+
+  // Rebuilds the table with new_groups groups (a power of two), dropping
+  // tombstones. The table is kept at most 7/8 full.
+  void Rehash(size_t new_groups) {
+    StatsTimer timer(&stats_.resize_nanos);
+    while (new_groups * SwissGroup::kWidth * 7 / 8 <= size_) {
+      new_groups *= 2;
+    }
+    int8_t *old_ctrl = ctrl_;
+    LRUHandle **old_slots = slots_;
+    const size_t old_capacity = Capacity();
+
+    groups_ = new_groups;
+    ctrl_ = new int8_t[Capacity()];
+    memset(ctrl_, kSwissEmpty, Capacity());
+    slots_ = new LRUHandle *[Capacity()];
+    memset(slots_, 0, sizeof(slots_[0]) * Capacity());
+    growth_left_ = Capacity() * 7 / 8 - size_;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_ctrl[i] >= 0) {
+        LRUHandle *h = old_slots[i];
+        size_t slot = FindInsertSlot(h->hash);
+        ctrl_[slot] = H2(h->hash);
+        slots_[slot] = h;
+      }
+    }
+    delete[] old_ctrl;
+    delete[] old_slots;
+  }
+
+  size_t groups_;
+  size_t size_;
+  size_t growth_left_;  // inserts into empty slots left before a rehash
+  int8_t *ctrl_;
+  LRUHandle **slots_;
+  CacheStats stats_;
+};
@@ -0,0 +1,144 @@
+// CacheSnapshotReader must hand out every record of an intact snapshot and
+// refuse any truncated, extended or corrupted one as a whole.
+//
+//   g++ -std=c++11 -O2 -o cache_snapshot_test comm/test/cache_snapshot_test.cc
+//   ./cache_snapshot_test
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+
+#include "../cache_snapshot.h"
+
+namespace {
+
+std::string path;
+
+std::string ReadFile(const std::string &name) {
+  std::string data;
+  FILE *file = fopen(name.c_str(), "rb");
+  assert(file != nullptr);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+    data.append(buf, n);
+  }
+  fclose(file);
+  return data;
+}
+
+void WriteFile(const std::string &name, const std::string &data) {
+  FILE *file = fopen(name.c_str(), "wb");
+  assert(file != nullptr);
+  assert(fwrite(data.data(), 1, data.size(), file) == data.size());
+  fclose(file);
+}
+
+// Whether Open() accepts data, and if so that it reads back three records.
+bool Accepts(const std::string &data) {
+  WriteFile(path, data);
+  errno = 0;
+  CacheSnapshotReader *reader = CacheSnapshotReader::Open(path);
+  if (reader == nullptr) {
+    assert(errno == EINVAL);
+    return false;
+  }
+  delete reader;
+  return true;
+}
+
+void WriteSample() {
+  CacheSnapshotWriter *writer = CacheSnapshotWriter::Create(path);
+  assert(writer != nullptr);
+  writer->Add("alpha", "1");
+  writer->Add("", "empty key");
+  writer->Add("gamma", "", 12345);
+  assert(writer->Finish());
+  delete writer;
+  assert(access((path + ".tmp").c_str(), F_OK) != 0);
+}
+
+void TestRoundTrip() {
+  WriteSample();
+  CacheSnapshotReader *reader = CacheSnapshotReader::Open(path);
+  assert(reader != nullptr);
+  assert(reader->count() == 3);
+  for (int pass = 0; pass < 2; pass++) {
+    Slice key, value;
+    uint64_t expire_at;
+    assert(reader->Next(&key, &value, &expire_at));
+    assert(key == Slice("alpha") && value == Slice("1") && expire_at == 0);
+    assert(reader->Next(&key, &value, &expire_at));
+    assert(key == Slice("") && value == Slice("empty key") && expire_at == 0);
+    assert(reader->Next(&key, &value, &expire_at));
+    assert(key == Slice("gamma") && value == Slice("") && expire_at == 12345);
+    assert(!reader->Next(&key, &value, &expire_at));
+    reader->Rewind();
+  }
+  delete reader;
+}
+
+void TestEmpty() {
+  CacheSnapshotWriter *writer = CacheSnapshotWriter::Create(path);
+  assert(writer->Finish());
+  delete writer;
+  CacheSnapshotReader *reader = CacheSnapshotReader::Open(path);
+  assert(reader != nullptr && reader->count() == 0);
+  Slice key, value;
+  uint64_t expire_at;
+  assert(!reader->Next(&key, &value, &expire_at));
+  delete reader;
+}
+
+void TestDamage() {
+  WriteSample();
+  const std::string good = ReadFile(path);
+  assert(Accepts(good));
+
+  for (size_t n = 0; n < good.size(); n++) {
+    assert(!Accepts(good.substr(0, n)));
+  }
+  assert(!Accepts(good + '\0'));
+  assert(!Accepts(good + good));
+
+  for (size_t i = 0; i < good.size(); i++) {
+    for (int bit = 0; bit < 8; bit += 3) {
+      std::string bad = good;
+      bad[i] ^= static_cast<char>(1 << bit);
+      if (Accepts(bad)) {
+        fprintf(stderr, "accepted a flip of bit %d at byte %zu\n", bit, i);
+        abort();
+      }
+    }
+  }
+
+  errno = 0;
+  assert(CacheSnapshotReader::Open(path + ".missing") == nullptr);
+  assert(errno == ENOENT);
+}
+
+// An abandoned writer leaves neither a file nor a temporary behind.
+void TestAbandonedWriter() {
+  unlink(path.c_str());
+  CacheSnapshotWriter *writer = CacheSnapshotWriter::Create(path);
+  writer->Add("k", "v");
+  delete writer;
+  assert(access(path.c_str(), F_OK) != 0);
+  assert(access((path + ".tmp").c_str(), F_OK) != 0);
+}
+
+}  // namespace
+
+int main() {
+  path = "/tmp/cache_snapshot_test." + std::to_string(getpid());
+  TestRoundTrip();
+  TestEmpty();
+  TestDamage();
+  TestAbandonedWriter();
+  unlink(path.c_str());
+  printf("PASS\n");
+  return 0;
+}
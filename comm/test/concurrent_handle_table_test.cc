@@ -0,0 +1,133 @@
+// Lock-free lookups on ConcurrentHandleTable while a writer grows and shrinks
+// it: a key that stays in the table must be found by every probe.
+//
+//   g++ -std=c++11 -O2 -pthread -o cht_test comm/test/concurrent_handle_table_test.cc
+//   ./cht_test
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../concurrent_handle_table.h"
+
+namespace {
+
+LRUHandle *NewHandle(const std::string &key) {
+  LRUHandle *e = static_cast<LRUHandle *>(malloc(LRUHandle::SizeOf(key.size())));
+  e->key_length = key.size();
+  e->hash = Hash32(key);
+  e->next_hash = nullptr;
+  memcpy(e->key_data, key.data(), key.size());
+  return e;
+}
+
+void FreeHandle(void *p) { free(p); }
+
+std::string Key(const char *prefix, int i) { return prefix + std::to_string(i); }
+
+void TestBasic() {
+  ConcurrentHandleTable table;
+  const int kKeys = 1000;
+  for (int i = 0; i < kKeys; i++) {
+    assert(table.Insert(NewHandle(Key("k", i))) == nullptr);
+  }
+  assert(table.size() == static_cast<size_t>(kKeys));
+
+  LRUHandle *replacement = NewHandle(Key("k", 7));
+  LRUHandle *old = table.Insert(replacement);
+  assert(old != nullptr && old != replacement);
+  table.Retire(old, &FreeHandle);
+  assert(table.size() == static_cast<size_t>(kKeys));
+
+  {
+    ConcurrentHandleTable::ReadGuard guard(&table);
+    for (int i = 0; i < kKeys; i++) {
+      LRUHandle *e = table.Lookup(Key("k", i));
+      assert(e != nullptr && e->key() == Slice(Key("k", i)));
+    }
+    assert(table.Lookup(Key("k", 7)) == replacement);
+    assert(table.Lookup(Key("missing", 0)) == nullptr);
+  }
+
+  // Shrinks back to the minimum size on the way down.
+  for (int i = 0; i < kKeys; i++) {
+    LRUHandle *e = table.Remove(Key("k", i));
+    assert(e != nullptr);
+    table.Retire(e, &FreeHandle);
+  }
+  assert(table.size() == 0);
+  assert(table.Remove(Key("k", 0)) == nullptr);
+  table.Reclaim();
+}
+
+// Readers probe permanent keys and never-inserted ones; the writer inserts
+// and removes churn keys in waves, so the table keeps growing and shrinking
+// under the readers.
+void TestResizeUnderReaders() {
+  ConcurrentHandleTable table;
+  const int kPermanent = 64;
+  const int kChurn = 5000;
+  const int kWaves = 8;
+  const int kReaders = 4;
+  for (int i = 0; i < kPermanent; i++) {
+    table.Insert(NewHandle(Key("perm", i)));
+  }
+
+  std::atomic<bool> done(false);
+  std::atomic<long> probes(0);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < kReaders; r++) {
+    readers.push_back(std::thread([&table, &done, &probes, r] {
+      long n = 0;
+      for (int i = r; !done.load(std::memory_order_relaxed); i++, n++) {
+        ConcurrentHandleTable::ReadGuard guard(&table);
+        const std::string key = Key("perm", i % kPermanent);
+        LRUHandle *e = table.Lookup(key);
+        if (e == nullptr || e->key() != Slice(key)) {
+          fprintf(stderr, "lost %s\n", key.c_str());
+          abort();
+        }
+        assert(table.Lookup(Key("never", i)) == nullptr);
+      }
+      probes += n;
+    }));
+  }
+
+  for (int w = 0; w < kWaves; w++) {
+    for (int i = 0; i < kChurn; i++) {
+      LRUHandle *old = table.Insert(NewHandle(Key("churn", i)));
+      assert(old == nullptr);
+    }
+    assert(table.size() == static_cast<size_t>(kPermanent + kChurn));
+    for (int i = 0; i < kChurn; i++) {
+      LRUHandle *e = table.Remove(Key("churn", i));
+      assert(e != nullptr);
+      table.Retire(e, &FreeHandle);
+    }
+    assert(table.size() == static_cast<size_t>(kPermanent));
+  }
+  done = true;
+  for (size_t r = 0; r < readers.size(); r++) {
+    readers[r].join();
+  }
+  assert(probes.load() > 0);
+
+  for (int i = 0; i < kPermanent; i++) {
+    table.Retire(table.Remove(Key("perm", i)), &FreeHandle);
+  }
+  table.Reclaim();
+}
+
+}  // namespace
+
+int main() {
+  TestBasic();
+  TestResizeUnderReaders();
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,121 @@
+// Lock-free hits of LRUCacheOptions::buffer_hits under every eviction
+// policy: concurrent lookups, inserts, erases and evictions must only ever
+// hand out live entries holding their own key's value, and every value must
+// be deleted exactly once.
+//
+//   g++ -std=c++11 -O2 -pthread -o hit_buffering_test comm/test/hit_buffering_test.cc
+//   ./hit_buffering_test
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../lru_cache.h"
+
+namespace {
+
+const int kThreads = 4;
+const int kKeys = 512;
+const int kOps = 100000;
+
+std::atomic<int> live_values(0);
+
+struct Value {
+  int key;
+  bool dead;
+};
+
+void DeleteValue(const Slice &key, void *value) {
+  Value *v = static_cast<Value *>(value);
+  assert(!v->dead && std::to_string(v->key) == key.ToString());
+  v->dead = true;
+  live_values--;
+  delete v;
+}
+
+void Worker(ShardedLRUCache *cache, int seed) {
+  uint32_t r = seed * 2654435761u + 1;
+  for (int i = 0; i < kOps; i++) {
+    r = r * 1103515245 + 12345;
+    const int k = (r >> 8) % kKeys;
+    const std::string key = std::to_string(k);
+    const int op = (r >> 20) % 16;
+    if (op == 0) {
+      cache->Erase(key);
+    } else if (op < 3) {
+      Value *v = new Value{k, false};
+      live_values++;
+      ShardedLRUCache::Handle *h = cache->Insert(key, v, 1, &DeleteValue);
+      assert(h != nullptr);
+      cache->Release(h);
+    } else {
+      ShardedLRUCache::Handle *h = cache->Lookup(key);
+      if (h != nullptr) {
+        const Value *v = static_cast<const Value *>(cache->Value(h));
+        assert(v->key == k && !v->dead);
+        cache->Release(h);
+      }
+    }
+  }
+}
+
+void Run(EvictionPolicyType policy, DeleterMode mode) {
+  LRUCacheOptions options;
+  options.capacity = kKeys / 4;  // keep evicting
+  options.num_shard_bits = 2;
+  options.eviction_policy = policy;
+  options.deleter_mode = mode;
+  options.buffer_hits = true;
+  {
+    ShardedLRUCache cache(options);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.push_back(std::thread(&Worker, &cache, t));
+    }
+    for (int t = 0; t < kThreads; t++) {
+      threads[t].join();
+    }
+    cache.Prune();
+    assert(cache.TotalCharge() == 0);
+  }
+  assert(live_values == 0);
+}
+
+// A hit pins the entry without the lock, and a pinned entry survives its
+// eviction until released.
+void TestPinnedHit() {
+  LRUCacheOptions options;
+  options.capacity = 1;
+  options.num_shard_bits = 0;
+  options.buffer_hits = true;
+  ShardedLRUCache cache(options);
+  live_values++;
+  cache.Release(cache.Insert("1", new Value{1, false}, 1, &DeleteValue));
+  ShardedLRUCache::Handle *h = cache.Lookup("1");
+  assert(h != nullptr);
+  live_values++;
+  cache.Release(cache.Insert("2", new Value{2, false}, 1, &DeleteValue));
+  assert(static_cast<const Value *>(cache.Value(h))->key == 1);
+  assert(live_values == 2);
+  cache.Release(h);
+  cache.Prune();
+  assert(live_values == 0);
+}
+
+}  // namespace
+
+int main() {
+  TestPinnedHit();
+  const EvictionPolicyType kPolicies[] = {kLRUEviction, kClockEviction, kTwoQueueEviction,
+                                          kTinyLFUEviction, kSampledEviction};
+  for (size_t p = 0; p < sizeof(kPolicies) / sizeof(kPolicies[0]); p++) {
+    Run(kPolicies[p], kInlineDeleters);
+    Run(kPolicies[p], kBatchedDeleters);
+  }
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,191 @@
+// Ordering between the shards' spills to a SecondaryCache, promotes back
+// from it, and client writes: a value read from the secondary tier must
+// never replace a newer Insert() or revive an Erase().
+//
+//   g++ -std=c++11 -O2 -pthread -o secondary_cache_test comm/test/secondary_cache_test.cc
+//   ./secondary_cache_test
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "../lru_cache.h"
+
+namespace {
+
+std::atomic<int> live_values(0);
+
+int *NewValue(int v) {
+  live_values++;
+  return new int(v);
+}
+
+void DeleteValue(const Slice &, void *value) {
+  live_values--;
+  delete static_cast<int *>(value);
+}
+
+class IntCodec : public CacheValueCodec {
+ public:
+  bool Serialize(const void *value, std::string *out) const override {
+    out->append(std::to_string(*static_cast<const int *>(value)));
+    return true;
+  }
+  void *Deserialize(const Slice &data, size_t *charge) const override {
+    *charge = 1;
+    return NewValue(atoi(data.ToString().c_str()));
+  }
+  CacheDeleter deleter() const override { return &DeleteValue; }
+};
+
+// A map that can hold a Lookup() after it has read the value, until the
+// test lets it go.
+class GatedSecondary : public SecondaryCache {
+ public:
+  GatedSecondary() : gate_closed_(false), waiting_(false) {}
+
+  void Insert(const Slice &key, uint32_t, const Slice &value) override {
+    std::lock_guard<std::mutex> l(mutex_);
+    map_[key.ToString()] = value.ToString();
+  }
+  bool Lookup(const Slice &key, uint32_t, std::string *value) override {
+    std::unique_lock<std::mutex> l(mutex_);
+    auto it = map_.find(key.ToString());
+    bool found = it != map_.end();
+    if (found) {
+      *value = it->second;
+    }
+    waiting_ = gate_closed_;
+    cv_.notify_all();
+    cv_.wait(l, [this] { return !gate_closed_; });
+    waiting_ = false;
+    return found;
+  }
+  void Erase(const Slice &key, uint32_t) override {
+    std::lock_guard<std::mutex> l(mutex_);
+    map_.erase(key.ToString());
+  }
+
+  bool Contains(const std::string &key) {
+    std::lock_guard<std::mutex> l(mutex_);
+    return map_.count(key) != 0;
+  }
+  void CloseGate() {
+    std::lock_guard<std::mutex> l(mutex_);
+    gate_closed_ = true;
+  }
+  // Waits for a Lookup() to have read its value and stopped at the gate.
+  void WaitForReader() {
+    std::unique_lock<std::mutex> l(mutex_);
+    cv_.wait(l, [this] { return waiting_; });
+  }
+  void OpenGate() {
+    std::lock_guard<std::mutex> l(mutex_);
+    gate_closed_ = false;
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<std::string, std::string> map_;
+  bool gate_closed_;
+  bool waiting_;
+};
+
+LRUCacheOptions Options(GatedSecondary *secondary, const IntCodec *codec) {
+  LRUCacheOptions options;
+  options.capacity = 1;
+  options.num_shard_bits = 0;
+  options.secondary_cache = secondary;
+  options.value_codec = codec;
+  return options;
+}
+
+// Value under key, or -1 on a miss.
+int Get(ShardedLRUCache *cache, const std::string &key) {
+  ShardedLRUCache::Handle *h = cache->Lookup(key);
+  if (h == nullptr) {
+    return -1;
+  }
+  int v = *static_cast<int *>(cache->Value(h));
+  cache->Release(h);
+  return v;
+}
+
+void Put(ShardedLRUCache *cache, const std::string &key, int v) {
+  cache->Release(cache->Insert(key, NewValue(v), 1, &DeleteValue));
+}
+
+// Puts key's value 1 into the secondary tier by evicting it.
+void Spill(ShardedLRUCache *cache, GatedSecondary *secondary, const std::string &key) {
+  Put(cache, key, 1);
+  Put(cache, "filler", 0);
+  assert(secondary->Contains(key));
+}
+
+void TestPromote() {
+  GatedSecondary secondary;
+  IntCodec codec;
+  ShardedLRUCache cache(Options(&secondary, &codec));
+  Spill(&cache, &secondary, "k");
+  assert(Get(&cache, "k") == 1);
+  assert(!secondary.Contains("k"));  // moved, not copied
+  assert(secondary.Contains("filler"));
+}
+
+// A newer value written to memory is spilled in its turn and wins over the
+// one spilled before it.
+void TestSpillAfterRewrite() {
+  GatedSecondary secondary;
+  IntCodec codec;
+  ShardedLRUCache cache(Options(&secondary, &codec));
+  Spill(&cache, &secondary, "k");
+  Put(&cache, "k", 2);
+  assert(!secondary.Contains("k"));
+  Put(&cache, "filler", 0);
+  assert(Get(&cache, "k") == 2);
+}
+
+// Promote reads 1, then the client writes 2 (or erases) before the promote
+// inserts: the promote must give up its stale value.
+void TestPromoteRacesWrite(bool erase) {
+  GatedSecondary secondary;
+  IntCodec codec;
+  ShardedLRUCache cache(Options(&secondary, &codec));
+  Spill(&cache, &secondary, "k");
+
+  secondary.CloseGate();
+  int promoted = 0;
+  std::thread reader([&cache, &promoted] { promoted = Get(&cache, "k"); });
+  secondary.WaitForReader();
+  if (erase) {
+    cache.Erase("k");
+  } else {
+    Put(&cache, "k", 2);
+  }
+  secondary.OpenGate();
+  reader.join();
+
+  const int expect = erase ? -1 : 2;
+  assert(promoted == expect);
+  assert(Get(&cache, "k") == expect);
+}
+
+}  // namespace
+
+int main() {
+  TestPromote();
+  TestSpillAfterRewrite();
+  TestPromoteRacesWrite(false);
+  TestPromoteRacesWrite(true);
+  assert(live_values == 0);
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,161 @@
+#pragma once
+#include <assert.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "lite_hash.h"
+
+// Milliseconds on the steady clock, the time base of entry TTLs.
+inline uint64_t ExpiryClockMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Hierarchical timing wheel over LRUHandleTimer::expire_at, in ticks of one
+// millisecond. Level l has kSlots slots of 64^l ticks each; an entry due in
+// less than 64^(l+1) ticks sits on level l, in the slot of its expiry time.
+// Whenever level 0 wraps, the current slot of level 1 is cascaded: its
+// entries are rescheduled relative to the new time and drop to a lower
+// level, and so on upwards. Schedule() and Cancel() are O(1); Advance()
+// touches each entry once per level it passes through. Entries due further
+// out than the top level covers (about 12 days) wait in the top level and
+// are rescheduled until they are in range.
+//
+// Slots are intrusive lists through the entries' timer()->next/pprev, so
+// only entries with a timer can be scheduled. Not thread-safe; the shard
+// lock covers it.
+class TimingWheel {
+ public:
+  static const int kLevels = 5;
+  static const int kSlotBits = 6;
+  static const size_t kSlots = size_t{1} << kSlotBits;
+
+  explicit TimingWheel(uint64_t now) : current_(now), size_(0) {
+    for (int l = 0; l < kLevels; l++) {
+      occupied_[l] = 0;
+      for (size_t s = 0; s < kSlots; s++) {
+        slot_[l][s] = nullptr;
+      }
+    }
+  }
+
+  // e->timer()->expire_at must be set. Entries already due fire on the next
+  // Advance().
+  void Schedule(LRUHandle *e) {
+    LRUHandleTimer *t = e->timer();
+    assert(t->pprev == nullptr);
+    uint64_t expire = t->expire_at < current_ ? current_ : t->expire_at;
+    uint64_t delta = expire - current_;
+    int level = 0;
+    while (level < kLevels - 1 && delta >> (kSlotBits * (level + 1)) != 0) {
+      level++;
+    }
+    if (delta >> (kSlotBits * kLevels) != 0) {
+      expire = current_ + (uint64_t{1} << (kSlotBits * kLevels)) - 1;
+    }
+    size_t slot = (expire >> (kSlotBits * level)) & (kSlots - 1);
+    LRUHandle **head = &slot_[level][slot];
+    t->next = *head;
+    if (*head != nullptr) {
+      (*head)->timer()->pprev = &t->next;
+    }
+    t->pprev = head;
+    *head = e;
+    occupied_[level] |= uint64_t{1} << slot;
+    size_++;
+  }
+
+  // No-op for entries that are not scheduled, or have no timer.
+  void Cancel(LRUHandle *e) {
+    if (!e->has_timer || e->timer()->pprev == nullptr) {
+      return;
+    }
+    LRUHandleTimer *t = e->timer();
+    LRUHandle **pprev = t->pprev;
+    *pprev = t->next;
+    if (t->next != nullptr) {
+      t->next->timer()->pprev = pprev;
+    }
+    t->next = nullptr;
+    t->pprev = nullptr;
+    size_--;
+    // A slot head points into slot_; clear its bit once the slot empties.
+    LRUHandle **first = &slot_[0][0];
+    if (pprev >= first && pprev < first + kLevels * kSlots && *pprev == nullptr) {
+      size_t index = pprev - first;
+      occupied_[index / kSlots] &= ~(uint64_t{1} << (index % kSlots));
+    }
+  }
+
+  // Moves time forward to now, unscheduling entries that expire at or
+  // before it and appending them to *expired, but no more than max of
+  // them. Returns true once caught up with now, false if it stopped at max.
+  bool Advance(uint64_t now, size_t max, std::vector<LRUHandle *> *expired) {
+    size_t taken = 0;
+    if (size_ == 0) {
+      current_ = now + 1 > current_ ? now + 1 : current_;
+      return true;
+    }
+    while (current_ <= now) {
+      const size_t slot = current_ & (kSlots - 1);
+      if (slot == 0) {
+        Cascade();
+      }
+      while (slot_[0][slot] != nullptr) {
+        if (taken == max) {
+          return false;
+        }
+        LRUHandle *e = slot_[0][slot];
+        Cancel(e);
+        if (e->timer()->expire_at > current_) {
+          Schedule(e);  // parked on the top level, still out of range
+        } else {
+          expired->push_back(e);
+          taken++;
+        }
+      }
+      // Skip to the next occupied slot of level 0, or to its wrap-around,
+      // which may need a cascade.
+      uint64_t later = occupied_[0] & ~((uint64_t{2} << slot) - 1);
+      uint64_t next = later != 0 ? (current_ & ~uint64_t{kSlots - 1}) + __builtin_ctzll(later)
+                                 : (current_ | (kSlots - 1)) + 1;
+      current_ = next < now + 1 ? next : now + 1;
+    }
+    return true;
+  }
+
+  size_t size() const { return size_; }
+
+ private:
+  // Called when current_ crosses a level-0 wrap: reschedules the current
+  // slot of level 1, and of each higher level whose lower level wrapped too.
+  void Cascade() {
+    for (int level = 1; level < kLevels; level++) {
+      size_t slot = (current_ >> (kSlotBits * level)) & (kSlots - 1);
+      LRUHandle *e = slot_[level][slot];
+      slot_[level][slot] = nullptr;
+      occupied_[level] &= ~(uint64_t{1} << slot);
+      while (e != nullptr) {
+        LRUHandleTimer *t = e->timer();
+        LRUHandle *next = t->next;
+        t->next = nullptr;
+        t->pprev = nullptr;
+        size_--;
+        Schedule(e);
+        e = next;
+      }
+      if (slot != 0) {
+        break;
+      }
+    }
+  }
+
+  uint64_t current_;  // next tick to process
+  size_t size_;
+  uint64_t occupied_[kLevels];  // bit s set iff slot_[level][s] is not empty
+  LRUHandle *slot_[kLevels][kSlots];
+};
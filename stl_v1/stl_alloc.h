@@ -1,14 +1,34 @@
 #pragma once
 
+#include <assert.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <mutex>
+#include <new>
+#include <thread>
 
 #include "stl_config.h"
 #include "type_traits.h"
 
+#if __STL_ALLOC_STATS && defined(__has_include)
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define __STL_HAS_BACKTRACE 1
+#endif
+#endif
+#ifndef __STL_HAS_BACKTRACE
+#define __STL_HAS_BACKTRACE 0
+#endif
+
 template <int __inst>
 class __malloc_alloc_template {
  private:
@@ -16,6 +36,7 @@ class __malloc_alloc_template {
   static void *_S_oom_realloc(void *, size_t);
 
   static void (*__malloc_alloc_oom_handler)();
+  static std::atomic<size_t> _S_oom_handler_calls;
 
  public:
   static void *allocate(size_t __n) {
@@ -41,11 +62,19 @@ class __malloc_alloc_template {
     __malloc_alloc_oom_handler = __f;
     return (__old);
   }
+
+  // Returns how many times the out-of-memory handler has been run.
+  static size_t oom_handler_calls() {
+    return _S_oom_handler_calls.load(std::memory_order_relaxed);
+  }
 };
 
 template <int __inst>
 void (*__malloc_alloc_template<__inst>::__malloc_alloc_oom_handler)() = 0;
 
+template <int __inst>
+std::atomic<size_t> __malloc_alloc_template<__inst>::_S_oom_handler_calls(0);
+
 template <int __inst>
 void *__malloc_alloc_template<__inst>::_S_oom_malloc(size_t __n) {
   void (*__my_malloc_handler)();
@@ -56,6 +85,7 @@ void *__malloc_alloc_template<__inst>::_S_oom_malloc(size_t __n) {
     if (0 == __my_malloc_handler) {
       __THROW_BAD_ALLOC;
     }
+    _S_oom_handler_calls.fetch_add(1, std::memory_order_relaxed);
     (*__my_malloc_handler)();
     __result = malloc(__n);
     if (__result) {
@@ -74,6 +104,7 @@ void *__malloc_alloc_template<__inst>::_S_oom_realloc(void *__p, size_t __n) {
     if (0 == __my_malloc_handler) {
       __THROW_BAD_ALLOC;
     }
+    _S_oom_handler_calls.fetch_add(1, std::memory_order_relaxed);
     (*__my_malloc_handler)();
     __result = realloc(__p, __n);
     if (__result) {
@@ -100,7 +131,148 @@ class simple_alloc {
 enum { _ALIGN = 8 };
 enum { _MAX_BYTES = 128 };
 enum { _NFREELISTS = 16 };
+// Objects moved between a thread cache and the central free lists at once.
+enum { _TRANSFER_OBJS = 20 };
+// A thread cache gives a batch back once a size class holds more than this.
+enum { _MAX_CACHED_OBJS = 2 * _TRANSFER_OBJS };
+// Batch descriptors obtained from malloc at once.
+enum { _BATCH_BLOCK = 64 };
+// Chunks are carved from spans of this size, aligned to it.
+enum { _SPAN_BYTES = 256 * 1024 };
+// A cache publishes its counts after this many operations.
+enum { _STATS_PUBLISH = 256 };
+// Sampled allocations kept, and frames recorded for each.
+enum { _PROFILE_SAMPLES = 128 };
+enum { _PROFILE_DEPTH = 32 };
+
+// Memory of a node allocator, see __default_alloc_template::memory_report().
+struct node_alloc_report {
+  size_t mapped_bytes;    // spans obtained from the system
+  size_t released_bytes;  // of those, given back by trim() and not reused
+  size_t resident_bytes;  // of those, resident according to mincore()
+  size_t free_bytes;      // on the central free lists
+  size_t live_bytes;      // carved and not free: in use, or in thread caches
+};
+
+// Counters of one size class, see __default_alloc_template::stats(). allocs,
+// frees and peak_live_bytes are only kept with __STL_ALLOC_STATS and read 0
+// without it; the rest is always reported.
+struct node_alloc_class_stats {
+  size_t size;             // bytes per object
+  size_t allocs;           // objects handed out
+  size_t frees;            // objects given back
+  size_t refills;          // chunks carved for the class
+  size_t live_bytes;       // handed out and not given back yet
+  size_t peak_live_bytes;  // high-water mark of live_bytes
+  size_t cached_bytes;     // carved and not live: on free lists or in caches
+};
+
+struct node_alloc_stats {
+  node_alloc_class_stats classes[_NFREELISTS];
+  size_t heap_bytes;         // spans obtained from the system
+  size_t released_bytes;     // of those, given back by trim() and not reused
+  size_t malloc_fallbacks;   // spans cut from malloc_alloc as mmap failed
+  size_t oom_handler_calls;  // runs of malloc_alloc's out-of-memory handler
+  size_t large_allocs;       // requests over _MAX_BYTES, passed to malloc_alloc
+  size_t samples;            // allocations sampled so far
+};
+
+// An allocation recorded by the sampling profiler. weight is the number of
+// bytes allocated since the thread's previous sample, which the sample
+// stands for.
+struct node_alloc_sample {
+  size_t size;
+  size_t weight;
+  int depth;
+  void *stack[_PROFILE_DEPTH];
+};
+
+/**
+    Treiber stack of _Node, which has an atomic _M_next. The head packs the
+   top pointer with a count of modifications in its upper _S_tag_bits bits,
+   so a pop that read a stale top fails its CAS even when that node is back
+   on top (ABA). Nodes are never freed, so a pop that lost a race may still
+   read _M_next of one safely.
+
+    User space addresses fit below the tag on the 64-bit targets supported,
+   but a 57-bit or tagged address would be silently truncated. Callers check
+   every node with _S_fits() before pushing it, in all builds.
+ */
+template <class _Node>
+struct _Tagged_stack {
+  enum { _S_tag_bits = 16 };
+  static const uint64_t _S_tag_one = (uint64_t)1 << (64 - _S_tag_bits);
+  static const uint64_t _S_ptr_mask = _S_tag_one - 1;
 
+  std::atomic<uint64_t> _M_head;
+
+  // Whether every address up to and including __p fits below the tag.
+  static bool _S_fits(const void *__p) {
+    return ((uint64_t)(uintptr_t)__p & ~_S_ptr_mask) == 0;
+  }
+
+  static _Node *_S_top(uint64_t __head) {
+    return (_Node *)(uintptr_t)(__head & _S_ptr_mask);
+  }
+  static uint64_t _S_next_head(uint64_t __old, _Node *__top) {
+    return ((__old & ~_S_ptr_mask) + _S_tag_one) | (uint64_t)(uintptr_t)__top;
+  }
+
+  void _M_push(_Node *__n) {
+    uint64_t __old = _M_head.load(std::memory_order_relaxed);
+    do {
+      __n->_M_next.store(_S_top(__old), std::memory_order_relaxed);
+    } while (!_M_head.compare_exchange_weak(__old, _S_next_head(__old, __n),
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
+  }
+
+  // Returns 0 if the stack is empty.
+  _Node *_M_pop() {
+    uint64_t __old = _M_head.load(std::memory_order_acquire);
+    for (;;) {
+      _Node *__n = _S_top(__old);
+      if (0 == __n) return 0;
+      _Node *__next = __n->_M_next.load(std::memory_order_relaxed);
+      if (_M_head.compare_exchange_weak(__old, _S_next_head(__old, __next),
+                                        std::memory_order_acquire,
+                                        std::memory_order_acquire)) {
+        return __n;
+      }
+    }
+  }
+};
+
+/**
+    Node allocator for objects of up to _MAX_BYTES bytes, carved from large
+   chunks and kept on one free list per size class.
+
+    With threads set, every thread allocates from and frees to a cache of its
+   own without taking any lock. Caches exchange objects with the central lists
+   in batches of _TRANSFER_OBJS, in the style of tcmalloc: an empty cache
+   fetches a batch, and a cache that grows past _MAX_CACHED_OBJS in a size
+   class returns one. A thread's cache is handed back to the central lists
+   when the thread exits.
+
+    The central lists of the threaded allocator are lock-free stacks of
+   batches, so a thread that frees what another one allocates never waits for
+   it. _S_node_allocator_lock only serializes carving new chunks.
+
+    Chunks come from _SPAN_BYTES spans mapped from the system, each starting
+   with a _Span header that counts the bytes carved from it, so the span of
+   any object is found by masking its address. trim() gathers the central
+   free lists, and every span whose carved bytes all turn out to be free is
+   given back with madvise(MADV_DONTNEED) and reused before new spans are
+   mapped. Objects held in other threads' caches keep their spans resident.
+
+    stats() reports per size class occupancy, measured by counting the
+   objects on the central lists and in the thread caches, and dump_stats()
+   prints it. With __STL_ALLOC_STATS, caches also count their allocations
+   and frees locally and publish them every _STATS_PUBLISH operations, so
+   the counts of other threads may lag behind a little. set_sample_interval()
+   then makes every thread record the call stack of about one allocation per
+   that many bytes into a ring of the last _PROFILE_SAMPLES samples.
+ */
 template <bool threads, int inst>
 class __default_alloc_template {
  private:
@@ -113,6 +285,7 @@ class __default_alloc_template {
     char _M_client_data[1];
   };
 
+  // Central free lists of the single-client allocator.
   static _Obj *_S_free_list[_NFREELISTS];
 
   static size_t _S_freelist_index(size_t __bytes) {
@@ -129,24 +302,335 @@ class __default_alloc_template {
   static char *_S_end_free;
   static size_t _S_heap_size;
 
+  // Chunks carved and objects carved per size class, and spans that had to
+  // come from malloc_alloc. Guarded by the lock.
+  static size_t _S_refills[_NFREELISTS];
+  static size_t _S_carved_objs[_NFREELISTS];
+  static size_t _S_malloc_fallbacks;
+
+  struct _Span {
+    _Span *_M_next;           // all spans
+    _Span *_M_next_released;  // released spans, for reuse
+    size_t _M_carved;         // bytes put on the free lists
+    size_t _M_free;           // free bytes found by the current trim()
+    bool _M_released;
+  };
+
+  static _Span *_S_spans;
+  static _Span *_S_released_spans;
+  static size_t _S_released_bytes;
+
+  static _Span *_S_span_of(const void *__p) {
+    return (_Span *)((uintptr_t)__p & ~(uintptr_t)(_SPAN_BYTES - 1));
+  }
+
+  // Where the part of a span that trim() may release starts: the first page
+  // after the header, which stays resident.
+  static size_t _S_span_release_offset() {
+    static const size_t __page = (size_t)sysconf(_SC_PAGESIZE);
+    return (sizeof(_Span) + __page - 1) & ~(__page - 1);
+  }
+
+  static _Span *_S_new_span();
+
+  // Moves every object on the central lists onto __lists. The lock must be
+  // held.
+  static void _S_collect(_Obj **__lists);
+  // Gives __lists back to the central lists in batches.
+  static void _S_restore(_Obj **__lists);
+  // Empties the caller's cache into the central lists. Must be called
+  // without the lock.
+  static void _S_flush_caches();
+
+  // Guards the chunk state above when threads is set.
   static std::mutex _S_node_allocator_lock;
 
+  class _Lock {
+   public:
+    _Lock() {
+      if (threads) _S_node_allocator_lock.lock();
+    }
+    ~_Lock() {
+      if (threads) _S_node_allocator_lock.unlock();
+    }
+  };
+
+  // A null-terminated chain of free objects on a central list. Descriptors
+  // are never freed, only recycled through _S_spare_batches, so a thread
+  // that lost a race may still read _M_next of one safely.
+  struct _Batch {
+    _Obj *_M_first;
+    int _M_count;
+    std::atomic<_Batch *> _M_next;
+  };
+
+  typedef _Tagged_stack<_Batch> _Batch_stack;
+
+  // Central free lists of the threaded allocator, and unused descriptors.
+  static _Batch_stack _S_central[_NFREELISTS];
+  static _Batch_stack _S_spare_batches;
+
+  // Heads of the descriptor blocks, linked through _M_next of their first
+  // element. Keeps the blocks, and through them the chunks, reachable for
+  // leak checkers, which cannot see through the tagged stack heads.
+  static std::atomic<_Batch *> _S_batch_blocks;
+
+  static _Batch *_S_new_batch() {
+    _Batch *__b = _S_spare_batches._M_pop();
+    if (0 != __b) return __b;
+    __b = (_Batch *)malloc_alloc::allocate(_BATCH_BLOCK * sizeof(_Batch));
+    // Checked in every build, as the stack heads would silently truncate it.
+    if (!_Batch_stack::_S_fits((char *)(__b + _BATCH_BLOCK) - 1)) {
+      fprintf(stderr, "__default_alloc_template: descriptor block at %p does "
+                      "not fit a tagged stack head\n", (void *)__b);
+      abort();
+    }
+    new (__b) _Batch();
+    _Batch *__old = _S_batch_blocks.load(std::memory_order_relaxed);
+    do {
+      __b->_M_next.store(__old, std::memory_order_relaxed);
+    } while (!_S_batch_blocks.compare_exchange_weak(
+        __old, __b, std::memory_order_release, std::memory_order_relaxed));
+    for (int __i = 2; __i < (int)_BATCH_BLOCK; __i++) {
+      _S_spare_batches._M_push(new (__b + __i) _Batch());
+    }
+    return new (__b + 1) _Batch();
+  }
+
+  // Puts the chain __first of __count objects of class __index on the
+  // central list.
+  static void _S_central_push(size_t __index, _Obj *__first, int __count) {
+    if (0 == __first) return;
+    if (!threads) {
+      _Obj *__last = __first;
+      while (0 != __last->_M_free_list_link) __last = __last->_M_free_list_link;
+      __last->_M_free_list_link = _S_free_list[__index];
+      _S_free_list[__index] = __first;
+      return;
+    }
+    _Batch *__b = _S_new_batch();
+    __b->_M_first = __first;
+    __b->_M_count = __count;
+    _S_central[__index]._M_push(__b);
+  }
+
+  // Takes a null-terminated chain off the central list of class __index, a
+  // whole batch when threads is set and a single object otherwise. Returns 0
+  // if the list is empty.
+  static _Obj *_S_central_pop(size_t __index, int &__count) {
+    if (!threads) {
+      _Obj *__result = _S_free_list[__index];
+      if (0 != __result) {
+        _S_free_list[__index] = __result->_M_free_list_link;
+        __result->_M_free_list_link = 0;
+        __count = 1;
+      }
+      return __result;
+    }
+    _Batch *__b = _S_central[__index]._M_pop();
+    if (0 == __b) return 0;
+    _Obj *__result = __b->_M_first;
+    __count = __b->_M_count;
+    _S_spare_batches._M_push(__b);
+    return __result;
+  }
+
+  // Free lists of a thread cache. Only the owner writes _M_length, through
+  // _M_set_length(), since stats() reads it from other threads.
+  struct _Cache {
+    _Obj *_M_free_list[_NFREELISTS];
+    int _M_length[_NFREELISTS];
+
+    void _M_set_length(size_t __index, int __n) {
+      __atomic_store_n(&_M_length[__index], __n, __ATOMIC_RELAXED);
+    }
+#if __STL_ALLOC_STATS
+    // Counts not yet published to _S_class_stats.
+    int _M_allocs[_NFREELISTS];
+    int _M_frees[_NFREELISTS];
+    int _M_ops;
+#endif
+  };
+
+#if __STL_ALLOC_STATS
+  struct _Class_stats {
+    std::atomic<size_t> _M_allocs;
+    std::atomic<size_t> _M_frees;
+    std::atomic<size_t> _M_peak_live;  // objects
+  };
+
+  static _Class_stats _S_class_stats[_NFREELISTS];
+  static std::atomic<size_t> _S_large_allocs;
+
+  static void _S_count(size_t __index, size_t __allocs, size_t __frees) {
+    _Class_stats &__st = _S_class_stats[__index];
+    if (0 != __frees) {
+      __st._M_frees.fetch_add(__frees, std::memory_order_relaxed);
+    }
+    if (0 == __allocs) return;
+    size_t __a =
+        __st._M_allocs.fetch_add(__allocs, std::memory_order_relaxed) +
+        __allocs;
+    size_t __f = __st._M_frees.load(std::memory_order_relaxed);
+    if (__a <= __f) return;
+    size_t __peak = __st._M_peak_live.load(std::memory_order_relaxed);
+    while (__a - __f > __peak &&
+           !__st._M_peak_live.compare_exchange_weak(
+               __peak, __a - __f, std::memory_order_relaxed)) {
+    }
+  }
+
+  static void _S_publish(_Cache *__cache) {
+    for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+      _S_count(__i, __cache->_M_allocs[__i], __cache->_M_frees[__i]);
+      __cache->_M_allocs[__i] = 0;
+      __cache->_M_frees[__i] = 0;
+    }
+    __cache->_M_ops = 0;
+  }
+
+  // Publishes the counts of the caller's cache.
+  static void _S_publish_caches();
+
+  // Bytes the calling thread may still allocate before its next sample.
+  struct _Sampler {
+    long _M_left;
+    size_t _M_drawn;  // _M_left when it was last drawn
+    uint32_t _M_rng;
+  };
+
+  static std::atomic<size_t> _S_sample_interval;
+  static thread_local _Sampler _S_sampler;
+  static std::mutex _S_profile_lock;
+  static node_alloc_sample _S_profile[_PROFILE_SAMPLES];
+  static size_t _S_sample_count;
+
+  static void _S_maybe_sample(size_t __n) {
+    if (0 == _S_sample_interval.load(std::memory_order_relaxed)) return;
+    if ((_S_sampler._M_left -= (long)__n) <= 0) _S_sample(__n);
+  }
+
+  static void _S_sample(size_t __n);
+#endif
+
+  enum { _S_cache_unused = 0, _S_cache_live, _S_cache_dead };
+
+  // Per-thread free lists. Trivially constructible and destructible, so it
+  // stays usable from destructors that run after the thread's _Cache_reaper.
+  struct _Thread_cache : _Cache {
+    int _M_state;
+    _Thread_cache *_M_next_live;
+  };
+
+  static thread_local _Thread_cache _S_cache;
+
+  // Live thread caches, for stats(). Guarded by the lock.
+  static _Thread_cache *_S_live_caches;
+
+  // Returns the thread's cache to the central lists at thread exit.
+  struct _Cache_reaper {
+    ~_Cache_reaper() {
+#if __STL_ALLOC_STATS
+      _S_publish(&_S_cache);
+#endif
+      _Lock __lock_instance;
+      for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+        _S_central_push(__i, _S_cache._M_free_list[__i],
+                        _S_cache._M_length[__i]);
+        _S_cache._M_free_list[__i] = 0;
+        _S_cache._M_set_length(__i, 0);
+      }
+      _Thread_cache **__link = &_S_live_caches;
+      while (*__link != &_S_cache) __link = &(*__link)->_M_next_live;
+      *__link = _S_cache._M_next_live;
+      _S_cache._M_state = _S_cache_dead;
+    }
+  };
+
+  // Returns the calling thread's cache, or 0 once it has been reaped.
+  static _Thread_cache *_S_thread_cache() {
+    if (_S_cache._M_state != _S_cache_live) {
+      if (_S_cache._M_state == _S_cache_dead) return 0;
+      static thread_local _Cache_reaper __reaper;
+      (void)__reaper;
+      _Lock __lock_instance;
+      _S_cache._M_next_live = _S_live_caches;
+      _S_live_caches = &_S_cache;
+      _S_cache._M_state = _S_cache_live;
+    }
+    return &_S_cache;
+  }
+
+  // Allocates straight from the central lists, refilling them from a chunk
+  // if needed.
+  static void *_S_central_allocate(size_t __n) {
+    size_t __index = _S_freelist_index(__n);
+#if __STL_ALLOC_STATS
+    _S_count(__index, 1, 0);
+#endif
+    int __count;
+    _Obj *__result = _S_central_pop(__index, __count);
+    if (0 == __result) {
+      _Lock __lock_instance;
+      // trim() empties the lists while it holds the lock; look again.
+      __result = _S_central_pop(__index, __count);
+      if (0 == __result) return _S_refill(_S_round_up(__n));
+    }
+    _S_central_push(__index, __result->_M_free_list_link, __count - 1);
+    return __result;
+  }
+
+  static void *_S_cache_allocate(_Cache *__cache, size_t __n) {
+    size_t __index = _S_freelist_index(__n);
+#if __STL_ALLOC_STATS
+    __cache->_M_allocs[__index]++;
+    if (++__cache->_M_ops >= (int)_STATS_PUBLISH) _S_publish(__cache);
+#endif
+    _Obj *__result = __cache->_M_free_list[__index];
+    if (0 == __result) return _S_fetch(__cache, __n);
+    __cache->_M_free_list[__index] = __result->_M_free_list_link;
+    __cache->_M_set_length(__index, __cache->_M_length[__index] - 1);
+    return __result;
+  }
+
+  static void _S_cache_deallocate(_Cache *__cache, void *__p, size_t __n) {
+    size_t __index = _S_freelist_index(__n);
+#if __STL_ALLOC_STATS
+    __cache->_M_frees[__index]++;
+    if (++__cache->_M_ops >= (int)_STATS_PUBLISH) _S_publish(__cache);
+#endif
+    _Obj *__q = (_Obj *)__p;
+    __q->_M_free_list_link = __cache->_M_free_list[__index];
+    __cache->_M_free_list[__index] = __q;
+    __cache->_M_set_length(__index, __cache->_M_length[__index] + 1);
+    if (__cache->_M_length[__index] > (int)_MAX_CACHED_OBJS) {
+      _S_release(__cache, __index);
+    }
+  }
+
+  // Slow paths of the thread caches.
+  static void *_S_fetch(_Cache *__cache, size_t __n);
+  static void _S_release(_Cache *__cache, size_t __index);
+
  public:
   static void *allocate(size_t __n) {
     void *__ret = 0;
+#if __STL_ALLOC_STATS
+    _S_maybe_sample(__n);
+#endif
     if (__n > (size_t)_MAX_BYTES) {
       // if __n is too big, use malloc
+#if __STL_ALLOC_STATS
+      _S_large_allocs.fetch_add(1, std::memory_order_relaxed);
+#endif
       __ret = malloc_alloc::allocate(__n);
+    } else if (threads) {
+      _Thread_cache *__cache = _S_thread_cache();
+      if (0 == __cache) return _S_central_allocate(__n);
+      __ret = _S_cache_allocate(__cache, __n);
     } else {
       // try to allocate __n bytes from free list
-      _Obj *__my_free_list = _S_free_list + _S_freelist_index(__n);
-      _Obj *__result = *__my_free_list;
-      if (0 == __result) {
-        __ret = _S_refill(_S_round_up(__n));
-      } else {
-        *__my_free_list = __result->_M_free_list_link;
-        __ret = __result;
-      }
+      __ret = _S_central_allocate(__n);
     }
     return __ret;
   }
@@ -154,15 +638,44 @@ class __default_alloc_template {
   static void deallocate(void *__p, size_t __n) {
     if (__n > (size_t)_MAX_BYTES) {
       malloc_alloc::deallocate(__p, __n);
-    } else {
-      _Obj *__my_free_list = _S_free_list + _S_freelist_index(__n);
+      return;
+    }
+    _Thread_cache *__cache = threads ? _S_thread_cache() : 0;
+    if (0 == __cache) {
+#if __STL_ALLOC_STATS
+      _S_count(_S_freelist_index(__n), 0, 1);
+#endif
       _Obj *__q = (_Obj *)__p;
-      __q->_M_free_list_link = *__my_free_list;
-      *__my_free_list = __q;
+      __q->_M_free_list_link = 0;
+      _S_central_push(_S_freelist_index(__n), __q, 1);
+      return;
     }
+    _S_cache_deallocate(__cache, __p, __n);
   }
 
   static void *reallocate(void *__p, size_t __old_sz, size_t __new_sz);
+
+  // Gives fully free spans back to the system and returns how many bytes
+  // were released.
+  static size_t trim();
+
+  // Fills *__r. Gathers the free lists like trim(), without releasing
+  // anything.
+  static void memory_report(node_alloc_report *__r);
+
+  // Fills *__s with the counters of the allocator.
+  static void stats(node_alloc_stats *__s);
+
+  // Prints the counters, and the sampled allocations if there are any.
+  static void dump_stats(FILE *__f);
+
+  // Makes every thread sample about one allocation per __bytes allocated, or
+  // stops sampling if __bytes is 0. Does nothing without __STL_ALLOC_STATS.
+  static void set_sample_interval(size_t __bytes);
+
+  // Copies up to __max of the most recent samples to __out, oldest first,
+  // and returns how many were copied.
+  static size_t sample_profile(node_alloc_sample *__out, size_t __max);
 };
 
 typedef __default_alloc_template<true, 0> alloc;
@@ -180,23 +693,76 @@ inline bool operator!=(const __default_alloc_template<__threads, __inst> &,
   return false;
 }
 
+/**
+    Returns one object of size __n and puts the rest of a central batch, or
+   of a freshly carved one, on the empty cache.
+ */
+template <bool __threads, int __inst>
+void *__default_alloc_template<__threads, __inst>::_S_fetch(_Cache *__cache,
+                                                            size_t __n) {
+  size_t __index = _S_freelist_index(__n);
+  int __count;
+  _Obj *__result = _S_central_pop(__index, __count);
+  if (0 == __result) {
+    _Lock __lock_instance;
+    // trim() empties the lists while it holds the lock, and another thread
+    // may have carved meanwhile; only carve if the list is still empty.
+    __result = _S_central_pop(__index, __count);
+    if (0 == __result) {
+      int __nobjs = _TRANSFER_OBJS;
+      char *__chunk = _S_chunk_alloc(_S_round_up(__n), __nobjs);
+      _S_refills[__index]++;
+      _S_carved_objs[__index] += __nobjs;
+      for (int __i = __nobjs - 1; __i >= 0; __i--) {
+        _Obj *__p = (_Obj *)(__chunk + __i * _S_round_up(__n));
+        __p->_M_free_list_link = __result;
+        __result = __p;
+      }
+      __count = __nobjs;
+    }
+  }
+  __cache->_M_free_list[__index] = __result->_M_free_list_link;
+  __cache->_M_set_length(__index, __count - 1);
+  return __result;
+}
+
+/**
+    Gives the _TRANSFER_OBJS most recently freed objects of class __index back
+   to the central list as one batch.
+ */
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::_S_release(_Cache *__cache,
+                                                            size_t __index) {
+  _Obj *__first = __cache->_M_free_list[__index];
+  _Obj *__last = __first;
+  for (int __i = 1; __i < (int)_TRANSFER_OBJS; __i++) {
+    __last = __last->_M_free_list_link;
+  }
+  __cache->_M_free_list[__index] = __last->_M_free_list_link;
+  __cache->_M_set_length(__index,
+                         __cache->_M_length[__index] - (int)_TRANSFER_OBJS);
+  __last->_M_free_list_link = 0;
+  _S_central_push(__index, __first, _TRANSFER_OBJS);
+}
+
 /**
     Returns an object of size __n,and optionally adds to size __n free list.
+   The lock must be held.
  */
 template <bool __threads, int __inst>
 void *__default_alloc_template<__threads, __inst>::_S_refill(size_t __n) {
   int __nobjs = 20;
   char *__chunk = _S_chunk_alloc(__n, __nobjs);
   _Obj *__result;
-  _Obj *__my_free_list;
   _Obj *__current_obj;
   _Obj *__next_obj;
   int __i;
 
+  _S_refills[_S_freelist_index(__n)]++;
+  _S_carved_objs[_S_freelist_index(__n)] += __nobjs;
   if (1 == __nobjs) return (__chunk);
-  __my_free_list = _S_free_list + _S_freelist_index(__n);
   __result = (_Obj *)__chunk;
-  *__my_free_list = __next_obj = (_Obj *)(__chunk + __n);
+  __next_obj = (_Obj *)(__chunk + __n);
   for (__i = 1;; __i++) {
     __current_obj = __next_obj;
     __next_obj = (_Obj *)((char *)__next_obj + __n);
@@ -207,12 +773,13 @@ void *__default_alloc_template<__threads, __inst>::_S_refill(size_t __n) {
       __current_obj->_M_free_list_link = __next_obj;
     }
   }
+  _S_central_push(_S_freelist_index(__n), (_Obj *)(__chunk + __n), __nobjs - 1);
   return __result;
 }
 
 /**
     We allocat memory in large chunks in order to avoid fragmenting the malloc
-   heap too much.
+   heap too much. The lock must be held.
  */
 template <bool __threads, int __inst>
 char *__default_alloc_template<__threads, __inst>::_S_chunk_alloc(
@@ -224,44 +791,375 @@ char *__default_alloc_template<__threads, __inst>::_S_chunk_alloc(
   if (__bytes_left >= __total_bytes) {
     __result = _S_start_free;
     _S_start_free += __total_bytes;
+    _S_span_of(__result)->_M_carved += __total_bytes;
     return __result;
   } else if (__bytes_left >= __size) {
     __nobjs = (int)(__bytes_left / __size);
     __total_bytes = __size * __nobjs;
     __result = _S_start_free;
     _S_start_free += __total_bytes;
+    _S_span_of(__result)->_M_carved += __total_bytes;
     return __result;
   } else {
-    size_t __bytes_to_get = 2 * __total_bytes + _S_round_up(_S_heap_size >> 4);
     if (__bytes_left > 0) {
-      _Obj *__my_free_list = _S_free_list + _S_freelist_index(__size);
-      ((_Obj *)_S_start_free)->_M_free_list_link = *__my_free_list;
-      *__my_free_list = (_Obj *)_S_start_free;
-    }
-    _S_start_free = (char *)malloc(__bytes_to_get);
-    if (0 == _S_start_free) {
-      size_t __i;
-      _Obj *__my_free_list;
-      _Obj *__p;
-      for (__i = __size; __i <= (size_t)(_MAX_BYTES); __i += (size_t)_ALIGN) {
-        __my_free_list = _S_free_list + _S_freelist_index(__i);
-        __p = *__my_free_list;
-        if (0 != __p) {
-          *__my_free_list = __p->_M_free_list_link;
-          _S_start_free = (char *)__p;
-          _S_end_free = _S_start_free + __i;
-          return (_S_chunk_alloc(__size, __nobjs));
-        }
-      }
-      _S_end_free = 0;
-      _S_start_free = (char *)malloc_alloc::allocate(__bytes_to_get);
+      ((_Obj *)_S_start_free)->_M_free_list_link = 0;
+      _S_span_of(_S_start_free)->_M_carved += __bytes_left;
+      _S_carved_objs[_S_freelist_index(__bytes_left)]++;
+      _S_central_push(_S_freelist_index(__bytes_left), (_Obj *)_S_start_free,
+                      1);
     }
-    _S_heap_size += __bytes_to_get;
-    _S_end_free = _S_start_free + __bytes_to_get;
+    _Span *__span = _S_new_span();
+    _S_start_free = (char *)__span + _S_round_up(sizeof(_Span));
+    _S_end_free = (char *)__span + _SPAN_BYTES;
     return (_S_chunk_alloc(__size, __nobjs));
   }
 }
 
+/**
+    Returns an empty span, reusing a released one if there is any. New spans
+   are mapped twice as large as needed and trimmed to alignment. If mapping
+   fails, the span is carved out of malloc_alloc memory, which runs the
+   out-of-memory handler. The lock must be held.
+ */
+template <bool __threads, int __inst>
+typename __default_alloc_template<__threads, __inst>::_Span *
+__default_alloc_template<__threads, __inst>::_S_new_span() {
+  _Span *__span = _S_released_spans;
+  if (0 != __span) {
+    _S_released_spans = __span->_M_next_released;
+    _S_released_bytes -= _SPAN_BYTES - _S_span_release_offset();
+    __span->_M_released = false;
+    return __span;
+  }
+  const size_t __map_bytes = 2 * (size_t)_SPAN_BYTES;
+  char *__p = (char *)mmap(0, __map_bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char *__base;
+  if (MAP_FAILED != (void *)__p) {
+    __base = (char *)(((uintptr_t)__p + _SPAN_BYTES - 1) &
+                      ~(uintptr_t)(_SPAN_BYTES - 1));
+    if (__base > __p) munmap(__p, __base - __p);
+    munmap(__base + _SPAN_BYTES, __p + __map_bytes - (__base + _SPAN_BYTES));
+  } else {
+    __p = (char *)malloc_alloc::allocate(__map_bytes);
+    _S_malloc_fallbacks++;
+    __base = (char *)(((uintptr_t)__p + _SPAN_BYTES - 1) &
+                      ~(uintptr_t)(_SPAN_BYTES - 1));
+  }
+  __span = (_Span *)__base;
+  __span->_M_next = _S_spans;
+  __span->_M_next_released = 0;
+  __span->_M_carved = 0;
+  __span->_M_free = 0;
+  __span->_M_released = false;
+  _S_spans = __span;
+  _S_heap_size += _SPAN_BYTES;
+  return __span;
+}
+
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::_S_flush_caches() {
+  if (!__threads) return;
+  if (_S_cache._M_state == _S_cache_live) {
+    for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+      _S_central_push(__i, _S_cache._M_free_list[__i], _S_cache._M_length[__i]);
+      _S_cache._M_free_list[__i] = 0;
+      _S_cache._M_set_length(__i, 0);
+    }
+  }
+}
+
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::_S_collect(_Obj **__lists) {
+  for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+    __lists[__i] = 0;
+    if (!__threads) {
+      __lists[__i] = _S_free_list[__i];
+      _S_free_list[__i] = 0;
+      continue;
+    }
+    int __count;
+    _Obj *__chain;
+    while (0 != (__chain = _S_central_pop(__i, __count))) {
+      _Obj *__last = __chain;
+      while (0 != __last->_M_free_list_link) __last = __last->_M_free_list_link;
+      __last->_M_free_list_link = __lists[__i];
+      __lists[__i] = __chain;
+    }
+  }
+}
+
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::_S_restore(_Obj **__lists) {
+  for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+    while (0 != __lists[__i]) {
+      _Obj *__first = __lists[__i];
+      _Obj *__last = __first;
+      int __count = 1;
+      while (__count < (int)_TRANSFER_OBJS && 0 != __last->_M_free_list_link) {
+        __last = __last->_M_free_list_link;
+        __count++;
+      }
+      __lists[__i] = __last->_M_free_list_link;
+      __last->_M_free_list_link = 0;
+      _S_central_push(__i, __first, __count);
+    }
+  }
+}
+
+template <bool __threads, int __inst>
+size_t __default_alloc_template<__threads, __inst>::trim() {
+  _S_flush_caches();
+  _Lock __lock_instance;
+  _Obj *__lists[_NFREELISTS];
+  _S_collect(__lists);
+  for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+    for (_Obj *__p = __lists[__i]; 0 != __p; __p = __p->_M_free_list_link) {
+      _S_span_of(__p)->_M_free += (__i + 1) * (size_t)_ALIGN;
+    }
+  }
+  // The span being carved is never released.
+  _Span *__current =
+      _S_end_free > _S_start_free ? _S_span_of(_S_start_free) : 0;
+  _Span *const __already_released = _S_released_spans;
+  size_t __released = 0;
+  for (_Span *__s = _S_spans; 0 != __s; __s = __s->_M_next) {
+    if (!__s->_M_released && __s != __current && __s->_M_carved > 0 &&
+        __s->_M_free == __s->_M_carved) {
+      __s->_M_released = true;
+      __s->_M_carved = 0;
+      __s->_M_next_released = _S_released_spans;
+      _S_released_spans = __s;
+      __released += _SPAN_BYTES - _S_span_release_offset();
+    }
+    __s->_M_free = 0;
+  }
+  if (0 == __released) {
+    _S_restore(__lists);
+    return 0;
+  }
+  // Unlink the objects of the released spans before their memory goes.
+  for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+    _Obj **__link = &__lists[__i];
+    while (0 != *__link) {
+      if (_S_span_of(*__link)->_M_released) {
+        *__link = (*__link)->_M_free_list_link;
+        _S_carved_objs[__i]--;
+      } else {
+        __link = &(*__link)->_M_free_list_link;
+      }
+    }
+  }
+  for (_Span *__s = _S_released_spans; __s != __already_released;
+       __s = __s->_M_next_released) {
+    madvise((char *)__s + _S_span_release_offset(),
+            _SPAN_BYTES - _S_span_release_offset(), MADV_DONTNEED);
+  }
+  _S_released_bytes += __released;
+  _S_restore(__lists);
+  return __released;
+}
+
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::memory_report(
+    node_alloc_report *__r) {
+  _S_flush_caches();
+  _Lock __lock_instance;
+  _Obj *__lists[_NFREELISTS];
+  _S_collect(__lists);
+  size_t __free = 0;
+  for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+    for (_Obj *__p = __lists[__i]; 0 != __p; __p = __p->_M_free_list_link) {
+      __free += (__i + 1) * (size_t)_ALIGN;
+    }
+  }
+  _S_restore(__lists);
+  size_t __carved = 0;
+  size_t __resident = 0;
+  const size_t __page = (size_t)sysconf(_SC_PAGESIZE);
+  unsigned char __vec[_SPAN_BYTES / 4096];
+  for (_Span *__s = _S_spans; 0 != __s; __s = __s->_M_next) {
+    __carved += __s->_M_carved;
+    if (0 == mincore(__s, _SPAN_BYTES, __vec)) {
+      for (size_t __i = 0; __i < _SPAN_BYTES / __page; __i++) {
+        if (__vec[__i] & 1) __resident += __page;
+      }
+    }
+  }
+  __r->mapped_bytes = _S_heap_size;
+  __r->released_bytes = _S_released_bytes;
+  __r->resident_bytes = __resident;
+  __r->free_bytes = __free;
+  __r->live_bytes = __carved - __free;
+}
+
+#if __STL_ALLOC_STATS
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::_S_publish_caches() {
+  if (!__threads) return;
+  if (_S_cache._M_state == _S_cache_live) _S_publish(&_S_cache);
+}
+
+/**
+    Records the allocation of __n bytes that used up the thread's sampling
+   budget and draws the next budget, uniformly between half and one and a
+   half sampling intervals so that periodic allocation patterns do not skew
+   the profile.
+ */
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::_S_sample(size_t __n) {
+  _Sampler &__s = _S_sampler;
+  const size_t __interval = _S_sample_interval.load(std::memory_order_relaxed);
+  if (0 == __interval) return;
+  const bool __first = 0 == __s._M_rng;
+  if (__first) __s._M_rng = (uint32_t)(uintptr_t)&__s | 1;
+  __s._M_rng ^= __s._M_rng << 13;
+  __s._M_rng ^= __s._M_rng >> 17;
+  __s._M_rng ^= __s._M_rng << 5;
+  const size_t __weight = __s._M_drawn - __s._M_left;
+  __s._M_drawn = __interval / 2 + __s._M_rng % (__interval + 1);
+  __s._M_left = (long)__s._M_drawn;
+  // A thread's first allocation only starts its budget.
+  if (__first) return;
+
+  node_alloc_sample __rec;
+  __rec.size = __n;
+  __rec.weight = __weight;
+#if __STL_HAS_BACKTRACE
+  __rec.depth = backtrace(__rec.stack, _PROFILE_DEPTH);
+#else
+  __rec.depth = 0;
+#endif
+  std::lock_guard<std::mutex> __l(_S_profile_lock);
+  _S_profile[_S_sample_count % _PROFILE_SAMPLES] = __rec;
+  _S_sample_count++;
+}
+#endif
+
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::stats(node_alloc_stats *__s) {
+#if __STL_ALLOC_STATS
+  _S_publish_caches();
+#endif
+  _Lock __lock_instance;
+  // Free objects per class: on the central lists, counted while they are
+  // gathered as in trim(), and in the thread caches.
+  size_t __free[_NFREELISTS];
+  _Obj *__lists[_NFREELISTS];
+  _S_collect(__lists);
+  for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+    __free[__i] = 0;
+    for (_Obj *__p = __lists[__i]; 0 != __p; __p = __p->_M_free_list_link) {
+      __free[__i]++;
+    }
+  }
+  _S_restore(__lists);
+  for (_Thread_cache *__t = _S_live_caches; 0 != __t; __t = __t->_M_next_live) {
+    for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+      __free[__i] += __atomic_load_n(&__t->_M_length[__i], __ATOMIC_RELAXED);
+    }
+  }
+  for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+    node_alloc_class_stats &__c = __s->classes[__i];
+    __c.size = (__i + 1) * (size_t)_ALIGN;
+    __c.refills = _S_refills[__i];
+    size_t __cached =
+        __free[__i] < _S_carved_objs[__i] ? __free[__i] : _S_carved_objs[__i];
+    __c.live_bytes = (_S_carved_objs[__i] - __cached) * __c.size;
+    __c.cached_bytes = __cached * __c.size;
+#if __STL_ALLOC_STATS
+    const _Class_stats &__st = _S_class_stats[__i];
+    __c.allocs = __st._M_allocs.load(std::memory_order_relaxed);
+    __c.frees = __st._M_frees.load(std::memory_order_relaxed);
+    __c.peak_live_bytes =
+        __st._M_peak_live.load(std::memory_order_relaxed) * __c.size;
+#else
+    __c.allocs = __c.frees = __c.peak_live_bytes = 0;
+#endif
+  }
+  __s->heap_bytes = _S_heap_size;
+  __s->released_bytes = _S_released_bytes;
+  __s->malloc_fallbacks = _S_malloc_fallbacks;
+  __s->oom_handler_calls = malloc_alloc::oom_handler_calls();
+#if __STL_ALLOC_STATS
+  __s->large_allocs = _S_large_allocs.load(std::memory_order_relaxed);
+  std::lock_guard<std::mutex> __l(_S_profile_lock);
+  __s->samples = _S_sample_count;
+#else
+  __s->large_allocs = 0;
+  __s->samples = 0;
+#endif
+}
+
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::dump_stats(FILE *__f) {
+  node_alloc_stats __s;
+  stats(&__s);
+  fprintf(__f,
+          "node allocator: heap %zu released %zu malloc fallbacks %zu "
+          "oom handler calls %zu large allocs %zu\n",
+          __s.heap_bytes, __s.released_bytes, __s.malloc_fallbacks,
+          __s.oom_handler_calls, __s.large_allocs);
+  fprintf(__f, "%5s %12s %12s %8s %12s %12s %12s\n", "size", "allocs",
+          "frees", "refills", "live", "peak live", "cached");
+  for (size_t __i = 0; __i < _NFREELISTS; __i++) {
+    const node_alloc_class_stats &__c = __s.classes[__i];
+    fprintf(__f, "%5zu %12zu %12zu %8zu %12zu %12zu %12zu\n", __c.size,
+            __c.allocs, __c.frees, __c.refills, __c.live_bytes,
+            __c.peak_live_bytes, __c.cached_bytes);
+  }
+  if (0 == __s.samples) return;
+  node_alloc_sample *__samples = (node_alloc_sample *)malloc_alloc::allocate(
+      _PROFILE_SAMPLES * sizeof(node_alloc_sample));
+  size_t __n = sample_profile(__samples, _PROFILE_SAMPLES);
+  fprintf(__f, "%zu allocations sampled, the last %zu:\n", __s.samples, __n);
+  for (size_t __i = 0; __i < __n; __i++) {
+    fprintf(__f, "size %zu weight %zu\n", __samples[__i].size,
+            __samples[__i].weight);
+#if __STL_HAS_BACKTRACE
+    fflush(__f);
+    backtrace_symbols_fd(__samples[__i].stack, __samples[__i].depth,
+                         fileno(__f));
+#else
+    for (int __j = 0; __j < __samples[__i].depth; __j++) {
+      fprintf(__f, "  %p\n", __samples[__i].stack[__j]);
+    }
+#endif
+  }
+  malloc_alloc::deallocate(__samples,
+                           _PROFILE_SAMPLES * sizeof(node_alloc_sample));
+}
+
+template <bool __threads, int __inst>
+void __default_alloc_template<__threads, __inst>::set_sample_interval(
+    size_t __bytes) {
+#if __STL_ALLOC_STATS
+  _S_sample_interval.store(__bytes, std::memory_order_relaxed);
+#else
+  (void)__bytes;
+#endif
+}
+
+template <bool __threads, int __inst>
+size_t __default_alloc_template<__threads, __inst>::sample_profile(
+    node_alloc_sample *__out, size_t __max) {
+#if __STL_ALLOC_STATS
+  std::lock_guard<std::mutex> __l(_S_profile_lock);
+  size_t __n = _S_sample_count < (size_t)_PROFILE_SAMPLES
+                   ? _S_sample_count
+                   : (size_t)_PROFILE_SAMPLES;
+  if (__n > __max) __n = __max;
+  for (size_t __i = 0; __i < __n; __i++) {
+    __out[__i] = _S_profile[(_S_sample_count - __n + __i) % _PROFILE_SAMPLES];
+  }
+  return __n;
+#else
+  (void)__out;
+  (void)__max;
+  return 0;
+#endif
+}
+
 template <bool threads, int inst>
 void *__default_alloc_template<threads, inst>::reallocate(void *__p,
                                                           size_t __old_sz,
@@ -289,12 +1187,125 @@ char *__default_alloc_template<__threads, __inst>::_S_end_free = 0;
 template <bool __threads, int __inst>
 size_t __default_alloc_template<__threads, __inst>::_S_heap_size = 0;
 
+template <bool __threads, int __inst>
+typename __default_alloc_template<__threads, __inst>::_Span
+    *__default_alloc_template<__threads, __inst>::_S_spans = 0;
+
+template <bool __threads, int __inst>
+typename __default_alloc_template<__threads, __inst>::_Span
+    *__default_alloc_template<__threads, __inst>::_S_released_spans = 0;
+
+template <bool __threads, int __inst>
+size_t __default_alloc_template<__threads, __inst>::_S_released_bytes = 0;
+
+template <bool __threads, int __inst>
+size_t __default_alloc_template<__threads, __inst>::_S_refills[_NFREELISTS];
+
+template <bool __threads, int __inst>
+size_t
+    __default_alloc_template<__threads, __inst>::_S_carved_objs[_NFREELISTS];
+
+template <bool __threads, int __inst>
+size_t __default_alloc_template<__threads, __inst>::_S_malloc_fallbacks = 0;
+
+#if __STL_ALLOC_STATS
+template <bool __threads, int __inst>
+typename __default_alloc_template<__threads, __inst>::_Class_stats
+    __default_alloc_template<__threads, __inst>::_S_class_stats[_NFREELISTS];
+
+template <bool __threads, int __inst>
+std::atomic<size_t>
+    __default_alloc_template<__threads, __inst>::_S_large_allocs(0);
+
+template <bool __threads, int __inst>
+std::atomic<size_t>
+    __default_alloc_template<__threads, __inst>::_S_sample_interval(0);
+
+template <bool __threads, int __inst>
+thread_local typename __default_alloc_template<__threads, __inst>::_Sampler
+    __default_alloc_template<__threads, __inst>::_S_sampler;
+
+template <bool __threads, int __inst>
+std::mutex __default_alloc_template<__threads, __inst>::_S_profile_lock;
+
+template <bool __threads, int __inst>
+node_alloc_sample
+    __default_alloc_template<__threads, __inst>::_S_profile[_PROFILE_SAMPLES];
+
+template <bool __threads, int __inst>
+size_t __default_alloc_template<__threads, __inst>::_S_sample_count = 0;
+#endif
+
+template <bool __threads, int __inst>
+std::mutex __default_alloc_template<__threads, __inst>::_S_node_allocator_lock;
+
+template <bool __threads, int __inst>
+thread_local typename __default_alloc_template<__threads, __inst>::_Thread_cache
+    __default_alloc_template<__threads, __inst>::_S_cache;
+
+template <bool __threads, int __inst>
+typename __default_alloc_template<__threads, __inst>::_Thread_cache
+    *__default_alloc_template<__threads, __inst>::_S_live_caches = 0;
+
+template <bool __threads, int __inst>
+typename __default_alloc_template<__threads, __inst>::_Batch_stack
+    __default_alloc_template<__threads, __inst>::_S_central[_NFREELISTS];
+
+template <bool __threads, int __inst>
+typename __default_alloc_template<__threads, __inst>::_Batch_stack
+    __default_alloc_template<__threads, __inst>::_S_spare_batches;
+
+template <bool __threads, int __inst>
+std::atomic<typename __default_alloc_template<__threads, __inst>::_Batch *>
+    __default_alloc_template<__threads, __inst>::_S_batch_blocks(0);
+
 template <bool __threads, int __inst>
 typename __default_alloc_template<__threads, __inst>::_Obj
     *__default_alloc_template<__threads, __inst>::_S_free_list[_NFREELISTS] = {
         0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 };
 
+/**
+    Calls _Alloc::trim() every __interval on a background thread, for as long
+   as the object lives.
+ */
+template <class _Alloc>
+class background_trim {
+ public:
+  explicit background_trim(std::chrono::milliseconds __interval)
+      : _M_interval(__interval), _M_stop(false) {
+    _M_thread = std::thread(&background_trim::_M_run, this);
+  }
+
+  ~background_trim() {
+    {
+      std::lock_guard<std::mutex> __l(_M_mutex);
+      _M_stop = true;
+    }
+    _M_cv.notify_one();
+    _M_thread.join();
+  }
+
+  background_trim(const background_trim &) = delete;
+  background_trim &operator=(const background_trim &) = delete;
+
+ private:
+  void _M_run() {
+    std::unique_lock<std::mutex> __l(_M_mutex);
+    while (!_M_cv.wait_for(__l, _M_interval, [this] { return _M_stop; })) {
+      __l.unlock();
+      _Alloc::trim();
+      __l.lock();
+    }
+  }
+
+  const std::chrono::milliseconds _M_interval;
+  std::mutex _M_mutex;
+  std::condition_variable _M_cv;
+  bool _M_stop;
+  std::thread _M_thread;
+};
+
 template <class _Tp>
 class allocator {
   typedef alloc _Alloc;
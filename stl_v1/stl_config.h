@@ -9,6 +9,13 @@
   fprintf(stderr, "out of memory\n"); \
   exit(1)
 
+// Count allocations and frees per size class in __default_alloc_template and
+// let it sample allocations with their call stacks, see its stats() and
+// set_sample_interval(). Costs a few instructions per allocation.
+#ifndef __STL_ALLOC_STATS
+#define __STL_ALLOC_STATS 0
+#endif
+
 #define __STL_REQUIRES(__type_var, __concept) \
   do {                                        \
   } while (0)
@@ -0,0 +1,123 @@
+// _Tagged_stack, the lock-free central list of the threaded node allocator:
+// LIFO order, the tag that defeats ABA, the address check, and concurrent
+// pushes and pops that must never hand a node to two threads at once.
+//
+//   g++ -std=c++11 -O2 -pthread stl_v1/test/tagged_stack_test.cc
+//   ./a.out
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../stl_alloc.h"
+
+namespace {
+
+struct Node {
+  std::atomic<Node *> _M_next;
+  std::atomic<int> owned;  // set while popped
+};
+
+typedef _Tagged_stack<Node> Stack;
+
+const int kNodes = 64;
+const int kThreads = 4;
+const int kRounds = 200000;
+
+void TestFits() {
+  int local;
+  assert(Stack::_S_fits(&local));
+  assert(Stack::_S_fits((void *)(uintptr_t)(Stack::_S_tag_one - 1)));
+  if (sizeof(void *) == 8) {
+    assert(!Stack::_S_fits((void *)(uintptr_t)Stack::_S_tag_one));
+    assert(!Stack::_S_fits((void *)(uintptr_t)((uint64_t)0xb4 << 56)));
+  }
+}
+
+void TestOrder() {
+  Stack s;
+  s._M_head.store(0);
+  Node n[3];
+  for (int i = 0; i < 3; i++) s._M_push(&n[i]);
+  for (int i = 2; i >= 0; i--) assert(s._M_pop() == &n[i]);
+  assert(s._M_pop() == 0);
+}
+
+// A pop that read A on top with B below, while others popped A and B and
+// pushed A back, must not install B as the new top.
+void TestABA() {
+  Stack s;
+  s._M_head.store(0);
+  Node a, b;
+  s._M_push(&b);
+  s._M_push(&a);
+  uint64_t stale = s._M_head.load();
+  assert(Stack::_S_top(stale) == &a);
+  assert(s._M_pop() == &a);
+  assert(s._M_pop() == &b);
+  s._M_push(&a);
+  assert(Stack::_S_top(s._M_head.load()) == &a);
+  uint64_t next = Stack::_S_next_head(stale, &b);
+  assert(!s._M_head.compare_exchange_strong(stale, next));
+  assert(s._M_pop() == &a);
+  assert(s._M_pop() == 0);
+}
+
+void Churn(Stack *s) {
+  std::vector<Node *> held;
+  for (int r = 0; r < kRounds; r++) {
+    if (held.size() < 4 && (r & 1) == 0) {
+      Node *n = s->_M_pop();
+      if (n != 0) {
+        int was = n->owned.exchange(1);
+        assert(was == 0);
+        (void)was;
+        held.push_back(n);
+      }
+    } else if (!held.empty()) {
+      Node *n = held.back();
+      held.pop_back();
+      n->owned.store(0);
+      s->_M_push(n);
+    }
+  }
+  for (size_t i = 0; i < held.size(); i++) {
+    held[i]->owned.store(0);
+    s->_M_push(held[i]);
+  }
+}
+
+void TestConcurrent() {
+  Stack s;
+  s._M_head.store(0);
+  std::vector<Node> nodes(kNodes);
+  for (int i = 0; i < kNodes; i++) {
+    nodes[i].owned.store(0);
+    s._M_push(&nodes[i]);
+  }
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) threads.push_back(std::thread(&Churn, &s));
+  for (int t = 0; t < kThreads; t++) threads[t].join();
+
+  std::vector<char> seen(kNodes);
+  for (int i = 0; i < kNodes; i++) {
+    Node *n = s._M_pop();
+    assert(n != 0 && !seen[n - &nodes[0]]);
+    seen[n - &nodes[0]] = 1;
+  }
+  assert(s._M_pop() == 0);
+}
+
+}  // namespace
+
+int main() {
+  TestFits();
+  TestOrder();
+  TestABA();
+  TestConcurrent();
+  printf("PASS\n");
+  return 0;
+}